@@ -0,0 +1,52 @@
+# ===========================================================================
+#          http://www.nongnu.org/autoconf-archive/ax_have_eventfd.html
+# ===========================================================================
+#
+# SYNOPSIS
+#
+#   AX_HAVE_EVENTFD([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# DESCRIPTION
+#
+#   This macro determines whether the system supports event counters that
+#   notify via file descriptors, i.e. eventfd(2). A neat usage example would
+#   be:
+#
+#     AX_HAVE_EVENTFD(
+#       [AX_CONFIG_FEATURE_ENABLE(eventfd)],
+#       [AX_CONFIG_FEATURE_DISABLE(eventfd)])
+#     AX_CONFIG_FEATURE(
+#       [eventfd], [This platform supports eventfd(2)],
+#       [HAVE_EVENTFD], [This platform supports eventfd(2).])
+#
+#   The interface was added to the Linux kernel in version 2.6.22; the flags
+#   EFD_NONBLOCK and EFD_CLOEXEC, which the check requires, appeared in
+#   2.6.27.
+#
+# LICENSE
+#
+#   Copyright (c) 2010 Peter Simons <simons@cryp.to>
+#
+#   Copying and distribution of this file, with or without modification, are
+#   permitted in any medium without royalty provided the copyright notice
+#   and this notice are preserved. This file is offered as-is, without any
+#   warranty.
+
+#serial 1
+
+AC_DEFUN([AX_HAVE_EVENTFD], [dnl
+  AC_MSG_CHECKING([for eventfd(2)])
+  AC_CACHE_VAL([ax_cv_have_eventfd], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [#include <sys/eventfd.h>],
+        [dnl
+int fd;
+fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);])],
+      [ax_cv_have_eventfd=yes],
+      [ax_cv_have_eventfd=no])])
+  AS_IF([test "${ax_cv_have_eventfd}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
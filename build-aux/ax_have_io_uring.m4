@@ -0,0 +1,64 @@
+# ===========================================================================
+#          http://www.nongnu.org/autoconf-archive/ax_have_io_uring.html
+# ===========================================================================
+#
+# SYNOPSIS
+#
+#   AX_HAVE_IO_URING([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# DESCRIPTION
+#
+#   This macro determines whether the system supports the io_uring(7)
+#   asynchronous I/O interface. A neat usage example would be:
+#
+#     AX_HAVE_IO_URING(
+#       [AX_CONFIG_FEATURE_ENABLE(io_uring)],
+#       [AX_CONFIG_FEATURE_DISABLE(io_uring)])
+#     AX_CONFIG_FEATURE(
+#       [io_uring], [This platform supports io_uring(7)],
+#       [HAVE_IO_URING], [This platform supports io_uring(7).])
+#
+#   The check doesn't require liburing; it looks for the kernel headers and
+#   the system call numbers only. The interface was added to the Linux
+#   kernel in version 5.1, but the check requires the headers of 5.19, which
+#   define provided buffer rings and cancellation by file descriptor.
+#   Whether the running kernel supports io_uring(7) -- or permits its use --
+#   can be determined at run-time only.
+#
+# LICENSE
+#
+#   Copyright (c) 2010 Peter Simons <simons@cryp.to>
+#
+#   Copying and distribution of this file, with or without modification, are
+#   permitted in any medium without royalty provided the copyright notice
+#   and this notice are preserved. This file is offered as-is, without any
+#   warranty.
+
+#serial 3
+
+AC_DEFUN([AX_HAVE_IO_URING], [dnl
+  AC_MSG_CHECKING([for io_uring(7)])
+  AC_CACHE_VAL([ax_cv_have_io_uring], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [dnl
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>],
+        [dnl
+struct io_uring_params p;
+struct io_uring_getevents_arg arg;
+struct io_uring_buf_reg reg;
+int fd;
+fd = syscall(__NR_io_uring_setup, 1, &p);
+fd = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+fd = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+fd = IORING_POLL_ADD_MULTI | IORING_CQE_F_MORE | IORING_FEAT_EXT_ARG | IORING_FEAT_SINGLE_MMAP;
+fd = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL | IOSQE_BUFFER_SELECT | IORING_CQE_F_BUFFER;])],
+      [ax_cv_have_io_uring=yes],
+      [ax_cv_have_io_uring=no])])
+  AS_IF([test "${ax_cv_have_io_uring}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
@@ -0,0 +1,53 @@
+# ===========================================================================
+#        http://www.nongnu.org/autoconf-archive/ax_have_so_busy_poll.html
+# ===========================================================================
+#
+# SYNOPSIS
+#
+#   AX_HAVE_SO_BUSY_POLL([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# DESCRIPTION
+#
+#   This macro determines whether the system supports the SO_BUSY_POLL
+#   socket option, which makes blocking receives and epoll_wait(2) poll the
+#   network device for a while before they sleep. A neat usage example
+#   would be:
+#
+#     AX_HAVE_SO_BUSY_POLL(
+#       [AX_CONFIG_FEATURE_ENABLE(so_busy_poll)],
+#       [AX_CONFIG_FEATURE_DISABLE(so_busy_poll)])
+#     AX_CONFIG_FEATURE(
+#       [so_busy_poll], [This platform supports SO_BUSY_POLL],
+#       [HAVE_SO_BUSY_POLL], [This platform supports SO_BUSY_POLL.])
+#
+#   On Linux, the option appeared in kernel version 3.11. Raising it above
+#   the net.core.busy_read sysctl requires CAP_NET_ADMIN.
+#
+# LICENSE
+#
+#   Copyright (c) 2010 Peter Simons <simons@cryp.to>
+#
+#   Copying and distribution of this file, with or without modification, are
+#   permitted in any medium without royalty provided the copyright notice
+#   and this notice are preserved. This file is offered as-is, without any
+#   warranty.
+
+#serial 1
+
+AC_DEFUN([AX_HAVE_SO_BUSY_POLL], [dnl
+  AC_MSG_CHECKING([for SO_BUSY_POLL])
+  AC_CACHE_VAL([ax_cv_have_so_busy_poll], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [#include <sys/types.h>
+#include <sys/socket.h>],
+        [dnl
+int flag = 1;
+int rc = setsockopt(0, SOL_SOCKET, SO_BUSY_POLL, &flag, sizeof(flag));])],
+      [ax_cv_have_so_busy_poll=yes],
+      [ax_cv_have_so_busy_poll=no])])
+  AS_IF([test "${ax_cv_have_so_busy_poll}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
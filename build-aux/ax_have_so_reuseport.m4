@@ -0,0 +1,52 @@
+# ===========================================================================
+#        http://www.nongnu.org/autoconf-archive/ax_have_so_reuseport.html
+# ===========================================================================
+#
+# SYNOPSIS
+#
+#   AX_HAVE_SO_REUSEPORT([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# DESCRIPTION
+#
+#   This macro determines whether the system supports the SO_REUSEPORT
+#   socket option, which allows several sockets to bind to the same address
+#   and port. A neat usage example would be:
+#
+#     AX_HAVE_SO_REUSEPORT(
+#       [AX_CONFIG_FEATURE_ENABLE(reuseport)],
+#       [AX_CONFIG_FEATURE_DISABLE(reuseport)])
+#     AX_CONFIG_FEATURE(
+#       [reuseport], [This platform supports SO_REUSEPORT],
+#       [HAVE_SO_REUSEPORT], [This platform supports SO_REUSEPORT.])
+#
+#   On Linux, the option appeared in kernel version 3.9; the kernel then
+#   distributes incoming connections over all listening sockets.
+#
+# LICENSE
+#
+#   Copyright (c) 2010 Peter Simons <simons@cryp.to>
+#
+#   Copying and distribution of this file, with or without modification, are
+#   permitted in any medium without royalty provided the copyright notice
+#   and this notice are preserved. This file is offered as-is, without any
+#   warranty.
+
+#serial 1
+
+AC_DEFUN([AX_HAVE_SO_REUSEPORT], [dnl
+  AC_MSG_CHECKING([for SO_REUSEPORT])
+  AC_CACHE_VAL([ax_cv_have_so_reuseport], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [#include <sys/types.h>
+#include <sys/socket.h>],
+        [dnl
+int flag = 1;
+int rc = setsockopt(0, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));])],
+      [ax_cv_have_so_reuseport=yes],
+      [ax_cv_have_so_reuseport=no])])
+  AS_IF([test "${ax_cv_have_so_reuseport}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
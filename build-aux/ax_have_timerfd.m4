@@ -0,0 +1,54 @@
+# ===========================================================================
+#          http://www.nongnu.org/autoconf-archive/ax_have_timerfd.html
+# ===========================================================================
+#
+# SYNOPSIS
+#
+#   AX_HAVE_TIMERFD([ACTION-IF-FOUND], [ACTION-IF-NOT-FOUND])
+#
+# DESCRIPTION
+#
+#   This macro determines whether the system supports timers that notify
+#   via file descriptors, i.e. timerfd_create(2). A neat usage example would
+#   be:
+#
+#     AX_HAVE_TIMERFD(
+#       [AX_CONFIG_FEATURE_ENABLE(timerfd)],
+#       [AX_CONFIG_FEATURE_DISABLE(timerfd)])
+#     AX_CONFIG_FEATURE(
+#       [timerfd], [This platform supports timerfd_create(2)],
+#       [HAVE_TIMERFD], [This platform supports timerfd_create(2).])
+#
+#   The interface was added to the Linux kernel in version 2.6.25; the flags
+#   TFD_NONBLOCK and TFD_CLOEXEC, which the check requires, appeared in
+#   2.6.27.
+#
+# LICENSE
+#
+#   Copyright (c) 2010 Peter Simons <simons@cryp.to>
+#
+#   Copying and distribution of this file, with or without modification, are
+#   permitted in any medium without royalty provided the copyright notice
+#   and this notice are preserved. This file is offered as-is, without any
+#   warranty.
+
+#serial 1
+
+AC_DEFUN([AX_HAVE_TIMERFD], [dnl
+  AC_MSG_CHECKING([for timerfd_create(2)])
+  AC_CACHE_VAL([ax_cv_have_timerfd], [dnl
+    AC_LINK_IFELSE([dnl
+      AC_LANG_PROGRAM(
+        [#include <sys/timerfd.h>],
+        [dnl
+int fd, rc;
+struct itimerspec its;
+fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+rc = timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, (struct itimerspec *)(0));])],
+      [ax_cv_have_timerfd=yes],
+      [ax_cv_have_timerfd=no])])
+  AS_IF([test "${ax_cv_have_timerfd}" = "yes"],
+    [AC_MSG_RESULT([yes])
+$1],[AC_MSG_RESULT([no])
+$2])
+])dnl
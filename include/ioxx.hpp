@@ -19,14 +19,20 @@
 #define IOXX_HPP_INCLUDED_2010_02_23
 
 #include <ioxx/acceptor.hpp>
+#include <ioxx/buffer_pool.hpp>
 #include <ioxx/core.hpp>
+#include <ioxx/core_group.hpp>
 #include <ioxx/dispatch.hpp>
 #include <ioxx/error.hpp>
+#include <ioxx/fd_map.hpp>
 #include <ioxx/iovec.hpp>
 #include <ioxx/schedule.hpp>
 #include <ioxx/signal.hpp>
 #include <ioxx/socket.hpp>
+#include <ioxx/stats.hpp>
+#include <ioxx/thread_pool.hpp>
 #include <ioxx/time.hpp>
+#include <ioxx/timing_wheel.hpp>
 
 /**
  * \namespace ioxx
@@ -33,6 +33,11 @@ namespace ioxx
    * handler function throws an exception, however, the newly received socket
    * is closed before the exception is propagated.
    *
+   * Several acceptors may share an endpoint if all of them are created with
+   * \c shared_port, typically one per thread of a ioxx::core_group. The
+   * kernel then distributes the incoming connections over them. This
+   * requires the \c SO_REUSEPORT socket option.
+   *
    * \sa \ref inetd
    */
   template < class Allocator = std::allocator<void>
@@ -51,20 +56,31 @@ namespace ioxx
     typedef typename socket::endpoint   endpoint;
     typedef Handler                     handler;
 
+    enum sharing_type { exclusive_port, shared_port };
+
     /**
      * Create an acceptor object.
      *
-     * \param disp The i/o event dispatcher (i.e. core) to register this acceptor in.
-     * \param addr Create a listening socket that's bound to this particular endpoint.
-     * \param f    Callback function to invoke every time new connection is received.
+     * \param disp    The i/o event dispatcher (i.e. core) to register this acceptor in.
+     * \param addr    Create a listening socket that's bound to this particular endpoint.
+     * \param f       Callback function to invoke every time new connection is received.
+     * \param sharing Whether other acceptors may listen on the same endpoint.
      */
-    acceptor(dispatch & disp, endpoint const & addr, handler const & f = handler())
+    acceptor(dispatch & disp, endpoint const & addr, handler const & f = handler(), sharing_type sharing = exclusive_port)
     : _ls(disp, addr.create(), boost::bind(&acceptor::run, this), socket::readable)
     , _f(f)
     {
       LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.acceptor." + detail::show(_ls.as_native_socket_t()));
       _ls.set_nonblocking();
       _ls.reuse_bind_address();
+      if (sharing == shared_port)
+      {
+#if defined IOXX_HAVE_REUSEPORT && IOXX_HAVE_REUSEPORT
+        _ls.reuse_port();
+#else
+        throw std::runtime_error("cannot share a listening port: SO_REUSEPORT is not supported on this platform");
+#endif
+      }
       _ls.bind(addr);
       _ls.listen(16u);
       LOGXX_TRACE("accepting connections on " << addr);
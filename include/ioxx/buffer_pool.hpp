@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_BUFFER_POOL_HPP_INCLUDED_2010_02_23
+#define IOXX_BUFFER_POOL_HPP_INCLUDED_2010_02_23
+
+#include <boost/noncopyable.hpp>
+#include <boost/assert.hpp>
+#include <vector>
+
+namespace ioxx
+{
+  /**
+   * A fixed number of equally sized receive buffers, carved out of one
+   * block of memory.
+   *
+   * A connection that keeps a receive buffer of its own ties up that memory
+   * even while it's idle, and most connections of a busy server are.
+   * Instead, a connection can acquire() a buffer when its socket becomes
+   * readable and release() it once the data has been consumed, so that
+   * buffers are held only by connections that have data in flight. acquire()
+   * hands out the most recently released buffer, which is likely to be
+   * cached.
+   *
+   * With \c io_uring(7), the kernel can pick a buffer out of the pool when
+   * data arrives; see core::async_socket::async_receive(). Such a pool
+   * belongs to the kernel as long as it's registered, so acquire() finds
+   * nothing in it. Without \c io_uring(7), core::socket::async_receive()
+   * acquires a buffer once the socket is readable and releases it when the
+   * handler returns.
+   *
+   * A buffer_pool is not thread-safe; use one per core.
+   */
+  class buffer_pool : private boost::noncopyable
+  {
+  public:
+    buffer_pool(size_t count, size_t buffer_size) : _memory(count * buffer_size), _buffer_size(buffer_size)
+    {
+      BOOST_ASSERT(count > 0u);
+      BOOST_ASSERT(buffer_size > 0u);
+      _free.reserve(count);
+      for (size_t i(count); i != 0u; --i)
+        _free.push_back(i - 1u);
+    }
+
+    /// The number of buffers.
+    size_t size() const         { return _memory.size() / _buffer_size; }
+
+    size_t buffer_size() const  { return _buffer_size; }
+
+    /// The number of buffers acquire() can hand out.
+    size_t available() const    { return _free.size(); }
+
+    /**
+     * Take a buffer of buffer_size() bytes out of the pool.
+     *
+     * \return The buffer, or 0 if all of them are in use.
+     */
+    char * acquire()
+    {
+      if (_free.empty()) return 0;
+      size_t const i( _free.back() );
+      _free.pop_back();
+      return buffer(i);
+    }
+
+    /**
+     * Return a buffer that was obtained from acquire().
+     */
+    void release(char * b)
+    {
+      BOOST_ASSERT(_free.size() < size());
+      _free.push_back(index(b));
+    }
+
+    char * buffer(size_t i)
+    {
+      BOOST_ASSERT(i < size());
+      return &_memory[i * _buffer_size];
+    }
+
+    size_t index(char const * b) const
+    {
+      BOOST_ASSERT(b >= &_memory[0] && b < &_memory[0] + _memory.size());
+      BOOST_ASSERT(static_cast<size_t>(b - &_memory[0]) % _buffer_size == 0u);
+      return static_cast<size_t>(b - &_memory[0]) / _buffer_size;
+    }
+
+  private:
+    std::vector<char>   _memory;
+    size_t const        _buffer_size;
+    std::vector<size_t> _free;
+  };
+
+} // namespace ioxx
+
+#endif // IOXX_BUFFER_POOL_HPP_INCLUDED_2010_02_23
@@ -21,42 +21,106 @@
 #include <ioxx/time.hpp>
 #include <ioxx/schedule.hpp>
 #include <ioxx/dispatch.hpp>
+#include <ioxx/buffer_pool.hpp>
+#include <ioxx/detail/eventfd.hpp>
+#include <ioxx/detail/mpsc_queue.hpp>
+#include <boost/function/function2.hpp>
+#include <vector>
+#include <cerrno>
+#include <unistd.h>
 #if defined IOXX_HAVE_ADNS && IOXX_HAVE_ADNS
 #  include <ioxx/detail/adns.hpp>
 #else
 #  error "No asynchronous DNS resolver available on this platform."
 #endif
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+#  include <ioxx/detail/timerfd.hpp>
+#endif
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+#  include <ioxx/detail/io_uring.hpp>
+#  include <boost/scoped_ptr.hpp>
+#  include <boost/shared_ptr.hpp>
+#endif
 
 namespace ioxx
 {
+  namespace detail
+  {
+    /**
+     * \internal
+     *
+     * The ioxx::dispatch of a core: the default one, with the core's
+     * statistics policy.
+     */
+    template <class Allocator, class Stats>
+    struct core_dispatch
+    {
+      typedef typename default_demux<Allocator>::type                           demux;
+      typedef boost::function1<void, typename demux::socket::event_set>         handler;
+      typedef typename default_handler_map<Allocator, handler>::type            handler_map;
+      typedef ioxx::dispatch<Allocator, demux, handler, handler_map, Stats>     type;
+    };
+  }
+
   /**
    * Asynchronous interface to socket I/O, time events, and DNS.
    *
+   * The \c Schedule parameter selects the time-event dispatcher. For
+   * example, a core that keeps its timeouts in a ioxx::timing_wheel is
+   *
+   * \code
+   *   typedef boost::function0<void>                                       task;
+   *   typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task, Allocator>  task_queue;
+   *   typedef ioxx::core< Allocator, ioxx::schedule<Allocator, task, task_queue> > io_core;
+   * \endcode
+   *
+   * On platforms that support \c timerfd_create(2), the schedule is driven
+   * by a timer file descriptor that is registered in the dispatcher like any
+   * other socket: expired timeouts run in the same event batch as socket
+   * I/O, and run() returns max_timeout() rather than the distance to the
+   * next deadline.
+   *
+   * The \c Stats policy is handed to the dispatcher and the DNS resolver;
+   * with ioxx::loop_stats, dispatch_stats() and dns_stats() tell where the
+   * loop spends its time. Timer statistics are kept by the schedule, so they
+   * need a \c Schedule with a \c Stats parameter of its own.
+   *
+   * A core belongs to the thread that runs it; the only member function
+   * other threads may call is post().
+   *
    * \sa \ref inetd
    */
-  template < class Allocator = std::allocator<void> >
+  template < class Allocator = std::allocator<void>
+           , class Schedule  = ioxx::schedule<Allocator>
+           , class Stats     = no_stats
+           >
   class core : public time_of_day
-             , public dispatch<Allocator>
-             , public schedule<Allocator>
+             , public detail::core_dispatch<Allocator, Stats>::type
+             , public Schedule
 #if defined IOXX_HAVE_ADNS && IOXX_HAVE_ADNS
-             , public detail::adns<Allocator>
+             , public detail::adns<Allocator, Schedule, typename detail::core_dispatch<Allocator, Stats>::type, Stats>
 #endif
   {
   public:
-    typedef Allocator                           allocator;
-    typedef ioxx::schedule<allocator>           schedule;
-    typedef ioxx::dispatch<allocator>           dispatch;
-    typedef detail::adns<allocator>             dns;
+    typedef Allocator                                                   allocator;
+    typedef Schedule                                                    schedule;
+    typedef typename detail::core_dispatch<allocator, Stats>::type      dispatch;
+    typedef detail::adns<allocator, schedule, dispatch, Stats>          dns;
 
     /**
      * An event-driven socket.
      *
+     * async_receive() reads into a buffer_pool the way
+     * async_socket::async_receive() does on \c io_uring(7), but with any
+     * demultiplexer: a buffer is acquired only once the socket is readable,
+     * and it goes back into the pool when the handler returns.
      */
     class socket : public dispatch::socket
     {
     public:
       typedef typename dispatch::socket::event_set event_set;
       typedef typename dispatch::socket::handler   handler;
+      typedef boost::function2<void, int, char *>  receive_completion;
 
       /**
        * Register a socket in the i/o event dispatcher.
@@ -71,11 +135,65 @@ namespace ioxx
       {
       }
 
+      template <class Trigger>
+      socket(core & io, native_socket_t sock, handler const & f, event_set ev, Trigger trigger)
+      : dispatch::socket(io, sock, f, ev, trigger)
+      {
+      }
+
       core &         get_core()         { return context(); }
       core const &   get_core() const   { return context(); }
 
+      /**
+       * Read once into a buffer of \c pool. The handler receives the number
+       * of bytes and the buffer, 0 at the end of the stream, or \c -errno
+       * and no buffer; \c -ENOBUFS means that the pool has run dry. This
+       * replaces the socket's handler and event set; the socket waits for
+       * nothing once the handler has run.
+       */
+      void async_receive(buffer_pool & pool, receive_completion const & f)
+      {
+        this->modify(boost::bind(&socket::receive_into, this, &pool, f, _1), socket::readable);
+      }
+
     protected:
       core & context() { return static_cast<core &>(dispatch::socket::context()); }
+
+    private:
+      // The arguments are copies, so f may replace this handler, or destroy
+      // the socket.
+      void receive_into(buffer_pool * pool, receive_completion f, event_set)
+      {
+        char * const b( pool->acquire() );
+        if (!b)
+        {
+          this->request(socket::no_events);
+          return f(-ENOBUFS, 0);
+        }
+        ssize_t const rc( ::read(this->as_native_socket_t(), b, pool->buffer_size()) );
+        int const err( errno );
+        if (rc < 0 && (err == EAGAIN || err == EWOULDBLOCK))
+        {
+          pool->release(b);     // nothing to read after all; keep waiting
+          return;
+        }
+        this->request(socket::no_events);
+        if (rc <= 0)
+        {
+          pool->release(b);
+          return f(rc < 0 ? -err : 0, 0);
+        }
+        try
+        {
+          f(static_cast<int>(rc), b);
+        }
+        catch(...)
+        {
+          pool->release(b);
+          throw;
+        }
+        pool->release(b);
+      }
     };
 
     class timeout : public schedule::timeout
@@ -87,11 +205,11 @@ namespace ioxx
       {
       }
 
-      timeout(core & sched, time_t ts, task const & f) : schedule::timeout(sched, ts, f)
+      timeout(core & sched, monotonic_time_t ts, task const & f, milliseconds_t slack = 0u) : schedule::timeout(sched, ts, f, slack)
       {
       }
 
-      timeout(core & sched, seconds_t to, task const & f) : schedule::timeout(sched, to, f)
+      timeout(core & sched, milliseconds_t to, task const & f, milliseconds_t slack = 0u) : schedule::timeout(sched, to, f, slack)
       {
       }
 
@@ -99,34 +217,355 @@ namespace ioxx
       core const &  get_core() const    { return static_cast<core const &>(schedule::timeout::get_schedule()); }
     };
 
-    core() : schedule(time_of_day::current_time_t()), dns(*this, *this, time_of_day::current_timeval())
+    class periodic : public schedule::periodic
     {
+    public:
+      typedef typename schedule::task task;
+
+      periodic(core & sched) : schedule::periodic(sched)
+      {
+      }
+
+      periodic(core & sched, milliseconds_t period, task const & f) : schedule::periodic(sched, period, f)
+      {
+      }
+
+      core &        get_core()          { return static_cast<core &>(schedule::periodic::get_schedule()); }
+      core const &  get_core() const    { return static_cast<core const &>(schedule::periodic::get_schedule()); }
+    };
+
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+    /**
+     * A socket with completion-based i/o. Rather than waiting until the
+     * socket is ready and then calling read() or write(), async_read() and
+     * async_write() hand the whole transfer to the kernel, which reports the
+     * number of bytes to the handler once it's done. All operations started
+     * during one iteration of the event loop are submitted by a single
+     * system call in wait(); their handlers run in run().
+     *
+     * async_receive() passes no buffer at all: the kernel picks one from a
+     * buffer_pool when data arrives, hands it to the handler, and gets it
+     * back when the handler returns, so that idle connections don't own
+     * receive buffers. The pool must outlive the core, and it belongs to the
+     * kernel from the first async_receive() on.
+     *
+     * Buffers must remain valid until the handler has run. Destroying the
+     * socket cancels its pending operations, whose handlers then see
+     * \c -ECANCELED.
+     *
+     * The core sets up an \c io_uring(7) instance when the first
+     * async_socket is created. Cancelling the operations of a socket by its
+     * file descriptor requires Linux 5.19 or later; on older kernels,
+     * creating the first async_socket throws a system_error, since the
+     * destructor couldn't keep operations from writing into buffers that
+     * are gone.
+     */
+    class async_socket : public system_socket
+    {
+    public:
+      typedef detail::io_uring::completion              completion;
+      typedef detail::io_uring::receive_completion      receive_completion;
+
+      async_socket(core & io, native_socket_t sock) : system_socket(sock), _io(io), _ring(io.ring())
+      {
+      }
+
+      ~async_socket()
+      {
+        try
+        {
+          _ring.cancel_operations(as_native_socket_t());
+        }
+        catch(std::exception const & e)
+        {
+          // The operations complete as usual then; nothing else can be done here.
+          LOGXX_ERROR("cannot cancel operations on socket " << as_native_socket_t() << ": " << e.what());
+        }
+      }
+
+      void async_read(char * begin, char * end, completion const & f)
+      {
+        _ring.read(as_native_socket_t(), begin, end, f);
+      }
+
+      void async_receive(buffer_pool & pool, receive_completion const & f)
+      {
+        _ring.receive(as_native_socket_t(), _io.provided(pool), f);
+      }
+
+      void async_write(char const * begin, char const * end, completion const & f)
+      {
+        _ring.write(as_native_socket_t(), begin, end, f);
+      }
+
+      /**
+       * Accept one connection; the handler receives the new socket, which
+       * is in non-blocking mode.
+       */
+      void async_accept(completion const & f)
+      {
+        _ring.accept(as_native_socket_t(), f);
+      }
+
+      core &        get_core()          { return _io; }
+      core const &  get_core() const    { return _io; }
+
+    private:
+      core &                    _io;
+      detail::io_uring &        _ring;
+    };
+#endif
+
+    core() : schedule(time_of_day::current_monotonic_time()), dns(*this, *this, time_of_day::current_timeval())
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+           , _timer_socket(*this, _timer.as_native_socket_t(), boost::bind(&core::expire_timer, this, _1), dispatch::socket::readable)
+#endif
+           , _wakeup_socket(*this, _wakeup.as_native_socket_t(), boost::bind(&core::acknowledge_posts, this, _1), dispatch::socket::readable)
+           , _deferred_head(0u), _idle_head(0u)
+    {
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+      _timer_socket.close_on_destruction(false);
+#endif
+      _wakeup_socket.close_on_destruction(false);
+      _internal_sockets = dispatch::size();
     }
 
     bool empty() const
     {
-      return schedule::empty() && dispatch::empty() && dns::empty();
+      return schedule::empty() && no_sockets() && dns::empty() && _posted.empty() && no_operations()
+          && _deferred_head == _deferred.size() && _idle_head == _idle.size();
     }
 
-    seconds_t run()
+    /**
+     * Run \c f right after the socket events of the current batch, e.g. to
+     * flush writes that several handlers have coalesced. Deferred tasks run
+     * in the order in which they were deferred, tasks they defer included,
+     * before run() moves on; tasks deferred outside of run() wait for the
+     * next batch. The queue is a vector that keeps its capacity, so
+     * deferring a task allocates no queue node.
+     */
+    void defer(typename schedule::task const & f)
     {
-      dispatch::run();
-      schedule::run();
+      _deferred.push_back(f);
+    }
+
+    /**
+     * Run \c f once the core has nothing else to do, i.e. when the following
+     * wait() would block. Idle tasks run in the order in which they were
+     * queued; a task that queues another idle task, itself included, defers
+     * it to the next time the core is idle, i.e. after the following wait().
+     */
+    void idle(typename schedule::task const & f)
+    {
+      _idle.push_back(f);
+    }
+
+    /**
+     * Run \c f in the thread that runs this core. This function may be
+     * called from any thread, including that one; it neither blocks nor
+     * takes a lock. The task runs in a later call of run(), after the socket
+     * events of that batch, and tasks posted by the same thread run in the
+     * order in which they were posted. Tasks that are still queued when the
+     * core is destroyed never run.
+     */
+    void post(typename schedule::task const & f)
+    {
+      if (_posted.push(f)) _wakeup.notify();
+    }
+
+    /**
+     * Deliver at most \c max_work socket events, and run at most \c
+     * max_work posted tasks, \c max_work operation completions, and \c
+     * max_work due tasks. Every kind of work has a budget of its own, so
+     * that a flood of socket events can't starve timers or posted tasks;
+     * one call may thus run up to four times \c max_work handlers, plus
+     * the deferred and idle tasks, which aren't budgeted. Work that exceeds
+     * the budget is left for the next call.
+     *
+     * \return The timeout for the following wait(): 0 if work is left over
+     *         or if there is nothing left to wait for. Idle tasks that
+     *         queue themselves again don't count as work left over, but
+     *         they don't make the loop block when neither a socket nor a
+     *         timer could wake it up, either.
+     */
+    milliseconds_t run(size_t max_work = std::numeric_limits<size_t>::max())
+    {
+      dispatch::run(max_work);
+      run_deferred();
+      run_posted(max_work);
+      run_completions(max_work);
       dns::run();
-      seconds_t timeout( schedule::run() );
-      if (schedule::empty())
+      milliseconds_t timeout( schedule::run(max_work) );
+      run_deferred();
+      if (dispatch::pending() || !_posted.empty() || completions_pending() || (timeout == 0u && !schedule::empty())) return 0u;
+      bool const idled( run_idle() );
+      if (idled)                                // idle tasks queued again wait for the next idle pass
+      {
+        run_deferred();
+        timeout = schedule::run(0u);            // only look for tasks they have scheduled
+        if (!_posted.empty() || completions_pending() || (timeout == 0u && !schedule::empty())) return 0u;
+      }
+      if (schedule::empty()) return no_sockets() ? 0u : dispatch::max_timeout();    // nothing else could wake us up
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+      _timer.arm(schedule::now() + timeout);
+      return dispatch::max_timeout();
+#else
+      return std::min(timeout, dispatch::max_timeout());
+#endif
+    }
+
+    /**
+     * Call run() with a budget of \c chunk until no work is left over or
+     * until \c budget milliseconds have passed. The clock is read after
+     * every chunk, i.e. after up to \c chunk units of every kind of work
+     * that run() budgets.
+     */
+    milliseconds_t run_for(milliseconds_t budget, size_t chunk = 64u)
+    {
+      BOOST_ASSERT(chunk > 0u);
+      monotonic_time_t const deadline( time_of_day::current_monotonic_time() + budget );
+      for (;;)
       {
-        if (dispatch::empty())  BOOST_ASSERT(timeout == 0u);
-        else                    timeout = dispatch::max_timeout();
+        milliseconds_t const timeout( run(chunk) );
+        if (timeout != 0u || (!dispatch::pending() && _posted.empty() && schedule::empty())) return timeout;
+        time_of_day::update();
+        if (time_of_day::current_monotonic_time() >= deadline) return 0u;
       }
-      return timeout;
     }
 
-    void wait(seconds_t timeout)
+#if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
+    /**
+     * Spin for up to \c max_spin microseconds in wait() before blocking;
+     * see detail::epoll for how the window adapts to the traffic. The
+     * demultiplexer, get_demux(), reports the time spent spinning and
+     * sleeping.
+     */
+    void busy_poll(unsigned int max_spin)
+    {
+      dispatch::get_demux().busy_poll(max_spin);
+    }
+#endif
+
+    void wait(milliseconds_t timeout)
     {
+      submit_operations();
       dispatch::wait(timeout);
       time_of_day::update();
     }
+
+  private:
+    void run_posted(size_t max_work)
+    {
+      typename schedule::task f;
+      for (size_t n(0u); n != max_work && _posted.pop(f); ++n)
+        f();
+    }
+
+    void run_deferred()
+    {
+      typename schedule::task f;
+      while (_deferred_head != _deferred.size())
+      {
+        swap(f, _deferred[_deferred_head++]);
+        f();
+      }
+      _deferred.clear();
+      _deferred_head = 0u;
+    }
+
+    bool run_idle()
+    {
+      size_t const end( _idle.size() );
+      if (_idle_head == end) return false;
+      typename schedule::task f;
+      while (_idle_head != end)
+      {
+        swap(f, _idle[_idle_head++]);
+        f();
+      }
+      if (_idle_head * 2u >= _idle.size())      // drop the tasks that ran
+      {
+        _idle.erase(_idle.begin(), _idle.begin() + _idle_head);
+        _idle_head = 0u;
+      }
+      return true;
+    }
+
+    void acknowledge_posts(typename dispatch::socket::event_set)
+    {
+      _wakeup.acknowledge();    // run() executes the posted tasks
+    }
+
+    bool no_sockets() const { return dispatch::size() == _internal_sockets; }
+
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+    detail::io_uring & ring()
+    {
+      if (!_ring)
+      {
+        boost::scoped_ptr<detail::io_uring> r( new detail::io_uring );
+        if (!r->cancels_by_fd()) throw system_error(ENOSYS, "io_uring can't cancel operations by file descriptor; async_socket needs Linux 5.19");
+        _ring_socket.reset(new typename dispatch::socket(*this, r->as_native_socket_t(), boost::bind(&core::acknowledge_completions, this, _1), dispatch::socket::readable));
+        _ring_socket->close_on_destruction(false);
+        _ring.swap(r);
+        ++_internal_sockets;
+      }
+      return *_ring;
+    }
+
+    detail::io_uring::buffer_ring & provided(buffer_pool & pool)
+    {
+      for (size_t i(0u); i != _buffer_rings.size(); ++i)
+        if (&_buffer_rings[i]->pool() == &pool) return *_buffer_rings[i];
+      BOOST_ASSERT(_buffer_rings.size() < 65536u);
+      boost::shared_ptr<detail::io_uring::buffer_ring> r( new detail::io_uring::buffer_ring(ring(), pool, static_cast<boost::uint16_t>(_buffer_rings.size())) );
+      _buffer_rings.push_back(r);
+      return *r;
+    }
+
+    void acknowledge_completions(typename dispatch::socket::event_set)
+    {
+      // run() executes the completion handlers
+    }
+
+    bool no_operations() const          { return !_ring || _ring->idle(); }
+    bool completions_pending() const    { return _ring && _ring->completed(); }
+    void run_completions(size_t max_work) { if (_ring) _ring->complete(max_work); }
+    void submit_operations()            { if (_ring) _ring->submit(); }
+#else
+    bool no_operations() const          { return true; }
+    bool completions_pending() const    { return false; }
+    void run_completions(size_t)        { }
+    void submit_operations()            { }
+#endif
+
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+    void expire_timer(typename dispatch::socket::event_set)
+    {
+      _timer.expire();          // run() executes the due tasks
+    }
+
+    detail::timerfd             _timer;
+    typename dispatch::socket   _timer_socket;
+#endif
+
+    detail::mpsc_queue<typename schedule::task> _posted;
+    detail::eventfd                             _wakeup;
+    typename dispatch::socket                   _wakeup_socket;
+    size_t                                      _internal_sockets;
+
+    typedef std::vector< typename schedule::task
+                       , typename Allocator::template rebind<typename schedule::task>::other
+                       > task_vector;
+    task_vector                                 _deferred;
+    size_t                                      _deferred_head;  // next deferred task to run
+    task_vector                                 _idle;
+    size_t                                      _idle_head;
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+    boost::scoped_ptr<detail::io_uring>         _ring;
+    boost::scoped_ptr<typename dispatch::socket> _ring_socket;
+    std::vector< boost::shared_ptr<detail::io_uring::buffer_ring> > _buffer_rings;
+#endif
   };
 
 } // namespace ioxx
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_CORE_GROUP_HPP_INCLUDED_2010_02_23
+#define IOXX_CORE_GROUP_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/core.hpp>
+#include <ioxx/detail/pthread.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <string>
+
+namespace ioxx
+{
+  /**
+   * Run one ioxx::core per thread.
+   *
+   * A core is strictly single-threaded, so a service that must use more
+   * than one CPU runs several of them: start() launches \c n threads, each
+   * of which constructs its own \c Core and then a \c Service object from
+   * that core, and runs the core's event loop until stop() is called. The
+   * \c Service type is any class that can be constructed from a
+   * <code>Core &</code>; it lives exactly as long as the thread's loop.
+   * Usually, it opens an ioxx::acceptor with \c shared_port on the same
+   * endpoint as all other threads, so that the kernel spreads incoming
+   * connections over the threads:
+   *
+   * \code
+   *   struct echo_service
+   *   {
+   *     echo_service(io_core & io) : tcp(io, endpoint("0.0.0.0", "7", socket::stream_service), bind(&echo::accept, ref(io), _1, _2), acceptor::shared_port) { }
+   *     acceptor tcp;
+   *   };
+   *
+   *   ioxx::core_group<io_core, echo_service> group;
+   *   group.start();
+   * \endcode
+   *
+   * Threads share nothing but the group object. start() returns once every
+   * thread has constructed its service; if any of them fails, start() stops
+   * the others and throws a \c std::runtime_error that describes the first
+   * failure. stop() wakes every thread through a pipe that is registered in
+   * its core, lets it destroy its service and core, and joins it.
+   *
+   * A thread whose loop throws later on logs the error and terminates; its
+   * share of the connections then waits in the kernel until stop(), which
+   * throws a \c std::runtime_error that describes the first such failure
+   * once all threads have been joined. running() remains true until then.
+   * The destructor stops a running group, too, but swallows the error.
+   *
+   * For every thread, the group keeps statistics about its loop. They are
+   * reliable only when the thread has been joined, i.e. after stop().
+   */
+  template < class Core
+           , class Service
+           >
+  class core_group : private boost::noncopyable
+  {
+  public:
+    typedef Core        core;
+    typedef Service     service;
+
+    struct statistics
+    {
+      statistics() : iterations(0u), busy(0u), idle(0u) { }
+
+      size_t            iterations;     ///< rounds of Core::run() and Core::wait()
+      monotonic_time_t  busy;           ///< milliseconds spent in Core::run()
+      monotonic_time_t  idle;           ///< milliseconds spent in Core::wait()
+    };
+
+    /**
+     * Prepare a group of \c n threads; the default is one per online CPU.
+     */
+    explicit core_group(size_t n = detail::online_cpus()) : _workers(n), _running(false)
+    {
+      BOOST_ASSERT(n > 0u);
+      LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.core_group(" + detail::show(this) + ')');
+    }
+
+    ~core_group()
+    {
+      if (!_running) return;
+      try { stop(); }
+      catch(std::exception const &) { }         // logged when it happened
+    }
+
+    size_t size() const { return _workers.size(); }
+
+    bool running() const { return _running; }
+
+    void start()
+    {
+      BOOST_ASSERT(!_running);
+      int ready[2];
+      throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, ready));
+      system_socket ready_in(ready[0]), ready_out(ready[1]);
+      _ready = &ready_out;
+      size_t started( 0u );
+      try
+      {
+        for (; started != _workers.size(); ++started)
+        {
+          worker & w( _workers[started] );
+          w = worker();
+          w.group = this;
+          int wake[2];
+          throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, wake));
+          w.wake_in.reset(new system_socket(wake[0]));
+          w.wake_out.reset(new system_socket(wake[1]));
+          w.wake_in->set_nonblocking();
+          detail::throw_if_pthread_error(pthread_create(&w.thread, 0, &core_group::thread_main, &w), "pthread_create(3)");
+        }
+      }
+      catch(...)
+      {
+        wait_for_startup(ready_in, started);
+        shut_down(started);
+        throw;
+      }
+      wait_for_startup(ready_in, started);
+      std::string const error( first_error(&worker::error) );
+      if (!error.empty())
+      {
+        shut_down(started);
+        throw std::runtime_error(error);
+      }
+      _running = true;
+      LOGXX_TRACE("started " << started << " threads");
+    }
+
+    /**
+     * Stop all threads and wait until they have terminated. Throws a \c
+     * std::runtime_error if a thread has failed since start().
+     */
+    void stop()
+    {
+      BOOST_ASSERT(_running);
+      shut_down(_workers.size());
+      _running = false;
+      LOGXX_TRACE("stopped");
+      std::string const error( first_error(&worker::failure) );
+      if (!error.empty()) throw std::runtime_error(error);
+    }
+
+    statistics const & stats(size_t i) const
+    {
+      BOOST_ASSERT(i < _workers.size());
+      return _workers[i].stats;
+    }
+
+  protected:
+    LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
+
+  private:
+    struct worker
+    {
+      worker() : group(0), thread() { }
+
+      core_group *                      group;
+      pthread_t                         thread;
+      boost::shared_ptr<system_socket>  wake_in, wake_out;
+      std::string                       error;          // of the startup, read once it's announced
+      std::string                       failure;        // of the loop, read once the thread is joined
+      statistics                        stats;
+    };
+
+    std::vector<worker> _workers;
+    system_socket *     _ready;
+    bool                _running;
+
+    static void * thread_main(void * p)
+    {
+      worker & w( *static_cast<worker *>(p) );
+      bool announced( false );
+      std::string error;
+      try
+      {
+        w.group->run(w, announced);
+      }
+      catch(std::exception const & e)
+      {
+        error = e.what();
+      }
+      catch(...)
+      {
+        error = "unknown exception";
+      }
+      if (!announced)
+      {
+        w.error = error;
+        w.group->announce();
+      }
+      else if (!error.empty())
+      {
+        w.failure = error;
+        w.group->failed(w);
+      }
+      return 0;
+    }
+
+    void failed(worker const & w)
+    {
+      LOGXX_ERROR("thread " << (&w - &_workers[0]) << " terminated: " << w.failure);
+    }
+
+    void run(worker & w, bool & announced)
+    {
+      core io;
+      bool stopped( false );
+      typename core::socket wake(io, w.wake_in->as_native_socket_t(), boost::bind(&core_group::wake_up, boost::ref(stopped), _1), core::socket::readable);
+      wake.close_on_destruction(false);
+      service svc(io);
+      announced = true;
+      announce();
+      for (milliseconds_t timeout( 0u ); !stopped; /**/)
+      {
+        monotonic_time_t const t0( io.current_monotonic_time() );
+        timeout = io.run();
+        io.update();
+        monotonic_time_t const t1( io.current_monotonic_time() );
+        if (stopped) break;
+        io.wait(timeout);
+        w.stats.iterations += 1u;
+        w.stats.busy       += t1 - t0;
+        w.stats.idle       += io.current_monotonic_time() - t1;
+      }
+    }
+
+    static void wake_up(bool & stopped, typename core::socket::event_set)
+    {
+      stopped = true;
+    }
+
+    void announce()
+    {
+      char const c( 0 );
+      _ready->write(&c, &c + 1);
+    }
+
+    void wait_for_startup(system_socket & ready_in, size_t n)
+    {
+      for (size_t i(0u); i != n; /**/)
+      {
+        char buf[64];
+        char * const p( ready_in.read(buf, buf + std::min(sizeof(buf), n - i)) );
+        BOOST_ASSERT(p && p != buf);
+        i += static_cast<size_t>(p - buf);
+      }
+    }
+
+    /**
+     * The first error that a thread has recorded in \c field. Only call this
+     * once the threads have written it: after they have announced their
+     * startup for \c worker::error, and after they have been joined for \c
+     * worker::failure.
+     */
+    std::string first_error(std::string worker::* field) const
+    {
+      for (size_t i(0u); i != _workers.size(); ++i)
+        if (!(_workers[i].*field).empty()) return _workers[i].*field;
+      return std::string();
+    }
+
+    void shut_down(size_t n)
+    {
+      char const c( 0 );
+      for (size_t i(0u); i != n; ++i)
+        _workers[i].wake_out->write(&c, &c + 1);
+      for (size_t i(0u); i != n; ++i)
+      {
+        int const rc( pthread_join(_workers[i].thread, 0) );
+        BOOST_ASSERT(rc == 0);
+        _workers[i].wake_in.reset();
+        _workers[i].wake_out.reset();
+      }
+    }
+  };
+
+} // namespace ioxx
+
+#endif // IOXX_CORE_GROUP_HPP_INCLUDED_2010_02_23
@@ -51,10 +51,14 @@ namespace ioxx { namespace detail
    * \internal
    *
    * \brief Asynchronous DNS resolver implementation based on GNU ADNS.
+   *
+   * With ioxx::loop_stats as the \c Stats policy, dns_stats() reports the
+   * time from submitting a query until its handler has run.
    */
   template < class Allocator = std::allocator<void>
            , class Schedule  = schedule<Allocator>
            , class Dispatch  = dispatch<Allocator>
+           , class Stats     = no_stats
            >
   class adns : private boost::noncopyable
   {
@@ -79,6 +83,8 @@ namespace ioxx { namespace detail
     typedef boost::function1<void, mxname_list *>       mx_handler;
     typedef boost::function1<void, hostname *>          ptr_handler;
 
+    typedef Stats                                       stats;
+
   public:
     adns(schedule & sched, dispatch & disp, timeval const & now)
     : _dispatch(disp), _now(now), _timeout(sched), _pfds(ADNS_POLLFDS_RECOMMENDED)
@@ -131,12 +137,14 @@ namespace ioxx { namespace detail
     {
       adns_query qid;
       throw_rc_if_not_zero(adns_submit_reverse(_state, &addr.as_sockaddr(), adns_r_ptr, adns_qf_none, static_cast<void*>(0), &qid), "adns_submit_reverse()");
-      _queries[qid] = boost::bind(handlePTR, _1, h);
+      _queries[qid] = timed(boost::bind(handlePTR, _1, h));
       check_consistency();
     }
 
     bool empty() const { return _queries.empty(); }
 
+    stats const & dns_stats() const { return _stats; }
+
     void run()
     {
       LOGXX_TRACE(  "run() has " << _queries.size() << " open queries and "
@@ -174,9 +182,7 @@ namespace ioxx { namespace detail
           }
           else
           {
-            seconds_t to( timeout / 1000 );
-            if (timeout % 1000) ++to;
-            _timeout.in(to, boost::bind(&adns::process_timeout, this));
+            _timeout.in(static_cast<milliseconds_t>(timeout), boost::bind(&adns::process_timeout, this));
             break;
           }
         }
@@ -233,6 +239,7 @@ namespace ioxx { namespace detail
     adns_state          _state;
     timeval const &     _now;
     timeout             _timeout;
+    stats               _stats;
 
     typedef boost::shared_ptr<adns_answer const> answer;
     typedef boost::function1<void, answer>       callback;
@@ -304,10 +311,22 @@ namespace ioxx { namespace detail
     {
       adns_query qid;
       throw_rc_if_not_zero(adns_submit(_state, owner, rrtype, flags, static_cast<void*>(0), &qid), "adns_submit()");
-      _queries[qid] = f;
+      _queries[qid] = timed(f);
       check_consistency();
     }
 
+    callback timed(callback const & f)
+    {
+      if (!stats::enabled) return f;
+      return boost::bind(&adns::timed_answer, this, stats::now(), f, _1);
+    }
+
+    void timed_answer(boost::uint64_t submitted, callback const & f, answer a)
+    {
+      f(a);
+      _stats.resolved(submitted);
+    }
+
     void register_fd(pollfd const & pfd)
     {
       LOGXX_TRACE("register new adns socket " << pfd.fd);
@@ -21,20 +21,75 @@
 #include <ioxx/socket.hpp>
 #include <ioxx/signal.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
 #include <algorithm>
 #include <limits>
+#include <vector>
 #include <iosfwd>
 #include <sys/epoll.h>
+#include <time.h>
 
 namespace ioxx { namespace detail
 {
-  typedef unsigned int seconds_t;
+  typedef unsigned int milliseconds_t;
 
   /**
    * \internal
    *
    * \brief I/O demultiplexer implementation based on \c epoll(7).
    *
+   * Every socket registers a pointer to itself in \c epoll_event.data, so
+   * pop_event() can report the socket object rather than just its file
+   * descriptor. A socket that is destroyed while events for it are queued
+   * removes those events, so a pointer that pop_event() returns is always
+   * valid, even if an earlier event handler in the same batch destroyed
+   * other sockets. Since the kernel reports a file descriptor at most once
+   * per wait, every socket remembers where its entry in the batch is, and
+   * where it is in the queues of ready and dirty sockets, so that going
+   * away costs the same no matter how large the batch is.
+   *
+   * Besides the events a socket requests, the kernel always reports \c
+   * hangup and \c error; a socket that requests \c read_hangup learns that
+   * the peer has shut down its side of a stream connection without a
+   * \c read(2) that returns 0.
+   *
+   * Sockets are level-triggered by default. An edge-triggered socket
+   * registers for all events once, with \c EPOLLET, and request() just
+   * changes which of them are reported to the application, without a
+   * system call. The socket remembers which edges it has seen and not yet
+   * reported; if request() asks for such an event later, the socket is
+   * reported on the next pop_event() without waiting for the kernel. An
+   * event is assumed to be used up once it has been reported, so the
+   * handler must read or write until the system call would block.
+   *
+   * Level-triggered sockets keep a shadow copy of the interest that is
+   * registered in the kernel. request() only updates the socket's wanted
+   * interest; the net change is applied with a single \c epoll_ctl(2) right
+   * before the next wait(), and not at all if the socket ends up wanting
+   * what it had. Consequently, an error in applying a request is reported
+   * by wait(). ctl_calls_avoided() counts the requests that didn't need a
+   * system call of their own.
+   *
+   * pop_batch() hands out the events of a wait() as one array, so that a
+   * dispatcher can loop over them without a function call per event.
+   *
+   * The array that receives events from the kernel starts out with \c
+   * size_hint entries. When a wait() fills it completely, it doubles in size
+   * before the next wait(), up to \c max_batch entries, so that a busy loop
+   * needs one \c epoll_wait(2) per iteration rather than several. The
+   * array never shrinks. batch_capacity(), waits(), events_received(), and
+   * full_batches() report how well the array fits the load.
+   *
+   * With busy_poll(), wait() polls the kernel without blocking for a while
+   * before it goes to sleep, which saves the wakeup latency when the next
+   * event is only microseconds away. The spin window adapts to the traffic:
+   * it doubles, up to the configured maximum, whenever spinning paid off or
+   * the loop was woken up shortly after it gave up, and it halves, down to
+   * nothing, whenever a spin found no event. spin_time() and sleep_time()
+   * tell how the loop spent its waits. Combine this with
+   * system_socket::set_busy_poll() to let the kernel poll the network
+   * device, too.
+   *
    * \sa http://www.kernel.org/doc/man-pages/online/pages/man7/epoll.7.html
    */
   class epoll : private boost::noncopyable
@@ -44,10 +99,13 @@ namespace ioxx { namespace detail
     {
     public:
       enum event_set
-        { no_events = 0
-        , readable  = EPOLLIN
-        , writable  = EPOLLOUT
-        , pridata   = EPOLLPRI
+        { no_events   = 0
+        , readable    = EPOLLIN
+        , writable    = EPOLLOUT
+        , pridata     = EPOLLPRI
+        , hangup      = EPOLLHUP
+        , error       = EPOLLERR
+        , read_hangup = EPOLLRDHUP
         };
 
       friend inline event_set & operator|= (event_set & lhs, event_set rhs) { return lhs = (event_set)((int)(lhs) | (int)(rhs)); }
@@ -56,56 +114,117 @@ namespace ioxx { namespace detail
       friend inline event_set   operator&  (event_set   lhs, event_set rhs) { return lhs &= rhs; }
       friend inline std::ostream & operator<< (std::ostream & os, event_set ev)
       {
-        if (ev == no_events) os << "None";
-        if (ev & readable)   os << "Read";
-        if (ev & writable)   os << "Write";
-        if (ev & pridata)    os << "Pridata";
+        if (ev == no_events)  os << "None";
+        if (ev & readable)    os << "Read";
+        if (ev & writable)    os << "Write";
+        if (ev & pridata)     os << "Pridata";
+        if (ev & hangup)      os << "Hangup";
+        if (ev & error)       os << "Error";
+        if (ev & read_hangup) os << "ReadHangup";
         return os;
       }
 
-      socket(epoll & demux, native_socket_t sock, event_set ev = no_events) : system_socket(sock), _epoll(demux)
+      enum trigger_type { level_triggered, edge_triggered };
+
+      socket(epoll & demux, native_socket_t sock, event_set ev = no_events, trigger_type trigger = level_triggered)
+      : system_socket(sock), _epoll(demux), _trigger(trigger), _wanted(ev), _registered(ev), _ready(no_events)
+      , _slot(unqueued()), _queued(unqueued()), _dirty(unqueued())
       {
         BOOST_ASSERT(sock >= 0);
         epoll_event e;
-        e.data.fd = as_native_socket_t();
-        e.events  = ev;
-        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "register socket " << e.data.fd  << " events " << ev);
+        e.data.ptr = this;
+        e.events   = trigger == edge_triggered ? static_cast<boost::uint32_t>(readable | writable | pridata | read_hangup | EPOLLET) : static_cast<boost::uint32_t>(ev);
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "register socket " << as_native_socket_t() << " events " << ev << (trigger == edge_triggered ? " edge-triggered" : ""));
         throw_errno_if_minus1("add socket into epoll", boost::bind(boost::type<int>(), &epoll_ctl, _epoll._epoll_fd, EPOLL_CTL_ADD, as_native_socket_t(), &e));
+        ++_epoll._ctl_calls;
       }
 
       ~socket()
       {
         LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "unregister " << *this);
+        _epoll.forget(this);
         if (close_on_destruction()) return;
         epoll_event e;
-        e.data.fd = as_native_socket_t();
-        e.events  = 0;
+        e.data.ptr = this;
+        e.events   = 0;
         throw_errno_if_minus1("del socket from epoll", boost::bind(boost::type<int>(), &epoll_ctl, _epoll._epoll_fd, EPOLL_CTL_DEL, as_native_socket_t(), &e));
+        ++_epoll._ctl_calls;
       }
 
       void request(event_set ev)
       {
-        epoll_event e;
-        e.data.fd = as_native_socket_t();
-        e.events  = ev;
-        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "modify socket " << e.data.fd << " events " << ev);
-        throw_errno_if_minus1("modify socket in epoll", boost::bind(boost::type<int>(), &epoll_ctl, _epoll._epoll_fd, EPOLL_CTL_MOD, as_native_socket_t(), &e));
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "socket " << as_native_socket_t() << " wants events " << ev);
+        ++_epoll._ctl_calls_avoided;
+        if (_trigger == edge_triggered)
+        {
+          if ((ev & _ready) && _queued == unqueued())
+            enqueue(_epoll._ready_sockets, &socket::_queued, this);
+        }
+        else if (ev != _wanted && _dirty == unqueued())
+          enqueue(_epoll._dirty_sockets, &socket::_dirty, this);
+        _wanted = ev;
       }
 
     protected:
       epoll & context() { return _epoll; }
 
     private:
-      epoll & _epoll;
+      friend class epoll;
+
+      /**
+       * Record the events the kernel reported and return those the
+       * application wants to see now.
+       */
+      event_set take(event_set ev)
+      {
+        if (_trigger == level_triggered) return ev;
+        _ready |= ev;
+        ev = _ready & (_wanted | hangup | error);
+        _ready = static_cast<event_set>(_ready & ~ev);
+        return ev;
+      }
+
+      /**
+       * Apply the wanted interest of a level-triggered socket.
+       */
+      void flush()
+      {
+        BOOST_ASSERT(_trigger == level_triggered);
+        _dirty = unqueued();
+        if (_wanted == _registered) return;
+        epoll_event e;
+        e.data.ptr = this;
+        e.events   = _wanted;
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "modify socket " << as_native_socket_t() << " events " << _wanted);
+        throw_errno_if_minus1("modify socket in epoll", boost::bind(boost::type<int>(), &epoll_ctl, _epoll._epoll_fd, EPOLL_CTL_MOD, as_native_socket_t(), &e));
+        _registered = _wanted;
+        --_epoll._ctl_calls_avoided;
+        ++_epoll._ctl_calls;
+      }
+
+      epoll &           _epoll;
+      trigger_type      _trigger;
+      event_set         _wanted;
+      event_set         _registered;    // level-triggered only: what the kernel knows
+      event_set         _ready;         // edge-triggered only: edges seen but not reported yet
+      size_t            _slot;          // entry in epoll::_events, if it's in the current batch
+      size_t            _queued;        // index in epoll::_ready_sockets or unqueued()
+      size_t            _dirty;         // index in epoll::_dirty_sockets or unqueued()
     };
 
-    static seconds_t max_timeout()
+    static milliseconds_t max_timeout()
     {
-      return static_cast<seconds_t>(std::numeric_limits<int>::max() / 1000);
+      return static_cast<milliseconds_t>(std::numeric_limits<int>::max());
     }
 
-    explicit epoll(unsigned int size_hint = 128u) : _n_events(0u), _current(0u)
+    explicit epoll(unsigned int size_hint = 128u, size_t max_batch = 65536u)
+    : _events(std::max<size_t>(1u, std::min<size_t>(size_hint, max_batch)))
+    , _n_events(0u), _current(0u)
+    , _max_batch(std::min<size_t>(max_batch, static_cast<size_t>(std::numeric_limits<int>::max())))
+    , _grow(false), _ctl_calls(0u), _ctl_calls_avoided(0u), _waits(0u), _received(0u), _full_batches(0u)
+    , _max_spin(0u), _spin_window(0u), _spin_time(0u), _sleep_time(0u), _spin_polls(0u)
     {
+      BOOST_ASSERT(max_batch > 0u);
       size_hint = std::min(size_hint, static_cast<unsigned int>(std::numeric_limits<int>::max()));
       _epoll_fd = throw_errno_if_minus1("create epoll socket", boost::bind(boost::type<int>(), &epoll_create, static_cast<int>(size_hint)));
       LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.epoll(" + detail::show(_epoll_fd) + ')');
@@ -116,34 +235,201 @@ namespace ioxx { namespace detail
       throw_errno_if_minus1("close epoll socket", boost::bind(boost::type<int>(), &::close, _epoll_fd));
     }
 
-    bool empty() const { return _n_events == 0u; }
+    bool empty() const { return _n_events == 0u && _ready_sockets.empty(); }
+
+    /**
+     * The number of socket::request() calls that did not cost an
+     * \c epoll_ctl(2) of their own.
+     */
+    size_t ctl_calls_avoided() const { return _ctl_calls_avoided; }
+
+    /// The number of calls of \c epoll_ctl(2) so far.
+    size_t ctl_calls() const { return _ctl_calls; }
+
+    /// The number of events the next wait() can receive.
+    size_t batch_capacity() const { return _grow ? std::min(2u * _events.size(), _max_batch) : _events.size(); }
+
+    /**
+     * The number of calls of \c epoll_wait(2) so far, not counting the
+     * polls of busy_poll() that found nothing.
+     */
+    size_t waits() const { return _waits; }
+
+    /// The number of events all of them have reported.
+    size_t events_received() const { return _received; }
+
+    /// The number of waits that filled the array, so that more events may have been ready.
+    size_t full_batches() const { return _full_batches; }
+
+    /**
+     * Spin for up to \c max_spin microseconds before a wait() blocks; 0,
+     * the default, turns spinning off. The window starts out at the
+     * maximum.
+     */
+    void busy_poll(unsigned int max_spin)
+    {
+      _max_spin = _spin_window = max_spin;
+    }
+
+    /// How long the next wait() may spin, in microseconds.
+    unsigned int spin_window() const { return _spin_window; }
+
+    /// Microseconds spent spinning so far.
+    boost::uint64_t spin_time() const { return _spin_time; }
+
+    /// The number of non-blocking polls made while spinning.
+    size_t spin_polls() const { return _spin_polls; }
+
+    /// Microseconds spent blocked in waits that followed a spin.
+    boost::uint64_t sleep_time() const { return _sleep_time; }
 
     bool pop_event(native_socket_t & sock, socket::event_set & ev)
     {
-      LOGXX_TRACE("pop_event() has " << _n_events << " events to deliver");
-      if (!_n_events) return false;
-      sock = _events[_current].data.fd;
-      ev   = static_cast<socket::event_set>(_events[_current].events);
-      ev  |= ev & EPOLLRDNORM ? socket::readable : socket::no_events; // weird, redundant extensions
-      ev  |= ev & EPOLLRDBAND ? socket::pridata  : socket::no_events;
-      ev  |= ev & EPOLLWRNORM ? socket::writable : socket::no_events;
-      ev  &= socket::readable | socket::writable | socket::pridata;
-      BOOST_ASSERT(ev != socket::no_events);
-      --_n_events; ++_current;
-      LOGXX_TRACE("deliver events " << ev << " on socket " << sock);
+      socket * s;
+      if (!pop_event(s, ev)) return false;
+      sock = s->as_native_socket_t();
       return true;
-   }
+    }
+
+    /**
+     * Like pop_event() above, but report the socket object itself.
+     */
+    bool pop_event(socket * & sock, socket::event_set & ev)
+    {
+      LOGXX_TRACE("pop_event() has " << _n_events << " events and " << _ready_sockets.size() << " ready sockets to deliver");
+      for (; _n_events; --_n_events, ++_current)
+      {
+        sock = static_cast<socket *>(_events[_current].data.ptr);
+        if (!sock) continue;
+        ev   = normalize(_events[_current].events);
+        BOOST_ASSERT(ev != socket::no_events || sock->_trigger == socket::edge_triggered);
+        ev   = sock->take(ev);
+        if (ev == socket::no_events) continue;
+        --_n_events; ++_current;
+        LOGXX_TRACE("deliver events " << ev << " on socket " << sock->as_native_socket_t());
+        return true;
+      }
+      while (!_ready_sockets.empty())
+      {
+        sock = _ready_sockets.back();
+        _ready_sockets.pop_back();
+        sock->_queued = unqueued();
+        ev = sock->take(socket::no_events);
+        if (ev == socket::no_events) continue;
+        LOGXX_TRACE("deliver remembered events " << ev << " on socket " << sock->as_native_socket_t());
+        return true;
+      }
+      return false;
+    }
+
+    /**
+     * A view of events that pop_batch() has taken from the demultiplexer.
+     * Entry \c i is the socket socket_at(i) with the events events_at(i).
+     * The flags are normalized, and edge-triggered sockets report only
+     * those edges they want; socket_at() returns 0 for an entry with
+     * nothing to report and for a socket that has been destroyed since the
+     * batch was taken. The view is valid until the next wait().
+     */
+    class batch
+    {
+    public:
+      size_t size() const                         { return static_cast<size_t>(_end - _begin); }
+      bool empty() const                          { return _begin == _end; }
+      socket * socket_at(size_t i) const          { BOOST_ASSERT(i < size()); return static_cast<socket *>(_begin[i].data.ptr); }
+      socket::event_set events_at(size_t i) const { BOOST_ASSERT(i < size()); return static_cast<socket::event_set>(_begin[i].events); }
+
+    private:
+      friend class epoll;
+      batch(epoll_event * b, epoll_event * e) : _begin(b), _end(e) { }
+      epoll_event *     _begin;
+      epoll_event *     _end;
+    };
 
-    void wait(seconds_t timeout)
+    /**
+     * Take up to \c max_events events of the last wait() out of the queue,
+     * so that the caller can deliver them in any order, or several times
+     * over, without the per-event cost of pop_event(). Edges that
+     * edge-triggered sockets remember from earlier batches are not part of
+     * the batch; pop_event() reports them.
+     */
+    batch pop_batch(size_t max_events = std::numeric_limits<size_t>::max())
+    {
+      size_t const n( std::min(max_events, _n_events) );
+      epoll_event * const b( &_events[0] + _current );
+      LOGXX_TRACE("pop_batch() takes " << n << " of " << _n_events << " events");
+      for (epoll_event * e( b ); e != b + n; ++e)
+      {
+        socket * const s( static_cast<socket *>(e->data.ptr) );
+        if (!s) continue;
+        e->events = s->take(normalize(e->events));
+        if (e->events == socket::no_events) e->data.ptr = 0;
+      }
+      _current  += n;
+      _n_events -= n;
+      return batch(b, b + n);
+    }
+
+    /**
+     * Return the entries of \c b from \c delivered on to the queue, e.g.
+     * because an event handler threw an exception. \c b must be the batch
+     * that pop_batch() returned last.
+     */
+    void unpop_batch(batch const & b, size_t delivered)
+    {
+      BOOST_ASSERT(delivered <= b.size());
+      BOOST_ASSERT(b._end == &_events[0] + _current);
+      size_t const n( b.size() - delivered );
+      _current  -= n;
+      _n_events += n;
+    }
+
+    void wait(milliseconds_t timeout)
     {
       BOOST_ASSERT(timeout <= max_timeout());
       BOOST_ASSERT(!_n_events);
+      while (!_dirty_sockets.empty())
+      {
+        socket * const s( _dirty_sockets.back() );
+        _dirty_sockets.pop_back();
+        s->flush();
+      }
+      if (_grow)
+      {
+        _events.resize(batch_capacity());
+        _grow = false;
+        LOGXX_TRACE("grow event array to " << _events.size() << " entries");
+      }
+      if (_max_spin == 0u || timeout == 0u) return receive(timeout);
+      boost::uint64_t const start( now() );
+      boost::uint64_t const spin_until( start + _spin_window );
+      boost::uint64_t t( start );
+      while (t < spin_until && !_n_events)
+      {
+        receive(0u, true);
+        t = now();
+      }
+      _spin_time += t - start;
+      if (_n_events) return widen_spin_window();
+      if (_spin_window) narrow_spin_window();
+      milliseconds_t const spun( static_cast<milliseconds_t>((t - start) / 1000u) );
+      receive(spun < timeout ? timeout - spun : 0u);
+      boost::uint64_t const woken( now() );
+      _sleep_time += woken - t;
+      if (_n_events && woken - t <= _max_spin) widen_spin_window();
+    }
+
+  protected:
+    LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
+
+  private:
+    void receive(milliseconds_t timeout, bool spinning = false)
+    {
 #if defined IOXX_HAVE_EPOLL_PWAIT && IOXX_HAVE_EPOLL_PWAIT
       sigset_t unblock_all;
       throw_errno_if_minus1("sigemptyset(3)", boost::bind(boost::type<int>(), &::sigemptyset, &unblock_all));
       int const rc( epoll_pwait( _epoll_fd
-                               , _events, sizeof(_events) / sizeof(epoll_event)
-                               , static_cast<int>(timeout) * 1000
+                               , &_events[0], static_cast<int>(_events.size())
+                               , static_cast<int>(timeout)
                                , &unblock_all
                                ));
 #else
@@ -151,8 +437,8 @@ namespace ioxx { namespace detail
       {
         signal_unblock signal_scope;
         rc = epoll_wait( _epoll_fd
-                       , _events, sizeof(_events) / sizeof(epoll_event)
-                       , static_cast<int>(timeout) * 1000
+                       , &_events[0], static_cast<int>(_events.size())
+                       , static_cast<int>(timeout)
                        );
       }
 #endif
@@ -165,16 +451,102 @@ namespace ioxx { namespace detail
       }
       _n_events = static_cast<size_t>(rc);
       _current    = 0u;
+      for (size_t i(0u); i != _n_events; ++i)
+        static_cast<socket *>(_events[i].data.ptr)->_slot = i;
+      if (spinning)
+      {
+        ++_spin_polls;
+        if (!_n_events) return;         // only the poll that finds events counts as a wait
+      }
+      ++_waits;
+      _received += _n_events;
+      if (_n_events == _events.size())
+      {
+        ++_full_batches;
+        _grow = _events.size() < _max_batch;
+      }
     }
 
-  protected:
-    LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
+    void widen_spin_window()
+    {
+      _spin_window = std::min(_max_spin, std::max(2u * _spin_window, _max_spin / 8u + 1u));
+      LOGXX_TRACE("spin for up to " << _spin_window << " microseconds");
+    }
+
+    void narrow_spin_window()
+    {
+      _spin_window = _spin_window / 2u > _max_spin / 8u ? _spin_window / 2u : 0u;
+      LOGXX_TRACE("spin for up to " << _spin_window << " microseconds");
+    }
+
+    static boost::uint64_t now()
+    {
+      timespec ts;
+      throw_errno_if_minus1("clock_gettime(2)", boost::bind(boost::type<int>(), clock_gettime, CLOCK_MONOTONIC, &ts));
+      return static_cast<boost::uint64_t>(ts.tv_sec) * 1000000u + static_cast<boost::uint64_t>(ts.tv_nsec) / 1000u;
+    }
+
+    static socket::event_set normalize(boost::uint32_t events)
+    {
+      socket::event_set ev( static_cast<socket::event_set>(events) );
+      ev |= ev & EPOLLRDNORM ? socket::readable : socket::no_events; // weird, redundant extensions
+      ev |= ev & EPOLLRDBAND ? socket::pridata  : socket::no_events;
+      ev |= ev & EPOLLWRNORM ? socket::writable : socket::no_events;
+      ev &= socket::readable | socket::writable | socket::pridata | socket::hangup | socket::error | socket::read_hangup;
+      return ev;
+    }
+
+    /**
+     * Drop the queued events of a socket that's going away, including those
+     * in a batch that is being delivered.
+     */
+    void forget(socket * s)
+    {
+      if (s->_slot < _current + _n_events && _events[s->_slot].data.ptr == s) _events[s->_slot].data.ptr = 0;
+      if (s->_queued != unqueued()) unqueue(_ready_sockets, &socket::_queued, s);
+      if (s->_dirty != unqueued())  unqueue(_dirty_sockets, &socket::_dirty, s);
+    }
+
+    static size_t unqueued() { return std::numeric_limits<size_t>::max(); }
+
+    static void enqueue(std::vector<socket *> & q, size_t socket::* pos, socket * s)
+    {
+      s->*pos = q.size();
+      q.push_back(s);
+    }
+
+    /**
+     * Remove \c s from \c q in constant time; the last socket in the queue
+     * takes its place.
+     */
+    static void unqueue(std::vector<socket *> & q, size_t socket::* pos, socket * s)
+    {
+      BOOST_ASSERT(s->*pos < q.size() && q[s->*pos] == s);
+      socket * const last( q.back() );
+      q[s->*pos] = last;
+      last->*pos = s->*pos;
+      q.pop_back();
+      s->*pos = unqueued();
+    }
 
-  private:
     native_socket_t     _epoll_fd;
-    epoll_event         _events[128];
+    std::vector<epoll_event> _events;
     size_t              _n_events;
     size_t              _current;
+    size_t              _max_batch;
+    bool                _grow;                  // the last wait() filled _events
+    std::vector<socket *> _ready_sockets;       // edge-triggered sockets with remembered events
+    std::vector<socket *> _dirty_sockets;       // level-triggered sockets with changed interest
+    size_t              _ctl_calls;
+    size_t              _ctl_calls_avoided;
+    size_t              _waits;
+    size_t              _received;
+    size_t              _full_batches;
+    unsigned int        _max_spin;              // microseconds; 0 if busy_poll() is off
+    unsigned int        _spin_window;
+    boost::uint64_t     _spin_time;
+    boost::uint64_t     _sleep_time;
+    size_t              _spin_polls;
   };
 
 }} // namespace ioxx::detail
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_DETAIL_EVENTFD_HPP_INCLUDED_2010_02_23
+#define IOXX_DETAIL_EVENTFD_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/socket.hpp>
+#include <boost/cstdint.hpp>
+#if defined IOXX_HAVE_EVENTFD && IOXX_HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#else
+#  include <unistd.h>
+#endif
+
+namespace ioxx { namespace detail
+{
+#if !(defined IOXX_HAVE_EVENTFD && IOXX_HAVE_EVENTFD)
+  struct pipe_pair
+  {
+    pipe_pair() { throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fd)); }
+    int fd[2];
+  };
+#endif
+
+  /**
+   * \internal
+   *
+   * \brief A wake-up call that other threads can send to an event loop.
+   *
+   * The object is an ordinary file descriptor that becomes readable after
+   * notify(), so any demultiplexer reports the notification like a socket
+   * event. notify() may be called from any thread; acknowledge() belongs to
+   * the thread that waits for the descriptor. Notifications that arrive
+   * before an acknowledge() are merged into one.
+   *
+   * On platforms without \c eventfd(2), a non-blocking pipe takes its place.
+   *
+   * \sa http://www.kernel.org/doc/man-pages/online/pages/man2/eventfd.2.html
+   */
+  class eventfd
+#if !(defined IOXX_HAVE_EVENTFD && IOXX_HAVE_EVENTFD)
+  : private pipe_pair
+  , public system_socket
+#else
+  : public system_socket
+#endif
+  {
+  public:
+#if defined IOXX_HAVE_EVENTFD && IOXX_HAVE_EVENTFD
+    eventfd() : system_socket(create())
+    {
+    }
+
+    void notify()
+    {
+      boost::uint64_t const n( 1u );
+      write(reinterpret_cast<char const *>(&n), reinterpret_cast<char const *>(&n + 1));
+    }
+
+    void acknowledge()
+    {
+      boost::uint64_t n;
+      read(reinterpret_cast<char *>(&n), reinterpret_cast<char const *>(&n + 1));
+    }
+
+  private:
+    static native_socket_t create()
+    {
+      return throw_errno_if_minus1("eventfd(2)", boost::bind(boost::type<int>(), &::eventfd, 0u, static_cast<int>(EFD_NONBLOCK | EFD_CLOEXEC)));
+    }
+#else
+    eventfd() : system_socket(pipe_pair::fd[0]), _out(pipe_pair::fd[1])
+    {
+      set_nonblocking();
+      _out.set_nonblocking();
+    }
+
+    void notify()
+    {
+      char const c( 0 );
+      _out.write(&c, &c + 1);   // a full pipe has a notification pending anyway
+    }
+
+    void acknowledge()
+    {
+      char buf[64];
+      while (read(buf, buf + sizeof(buf)) == buf + sizeof(buf)) { }
+    }
+
+  private:
+    system_socket       _out;
+#endif
+  };
+
+}} // namespace ioxx::detail
+
+#endif // IOXX_DETAIL_EVENTFD_HPP_INCLUDED_2010_02_23
@@ -0,0 +1,893 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_DETAIL_IO_URING_HPP_INCLUDED_2010_02_23
+#define IOXX_DETAIL_IO_URING_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/socket.hpp>
+#include <ioxx/buffer_pool.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function/function1.hpp>
+#include <boost/function/function2.hpp>
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <iosfwd>
+#include <cstring>
+#include <utility>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+namespace ioxx { namespace detail
+{
+  typedef unsigned int milliseconds_t;
+
+  /**
+   * \internal
+   *
+   * \brief I/O demultiplexer implementation based on \c io_uring(7).
+   *
+   * Interest in a socket is a poll request in the kernel's submission
+   * queue. Like detail::epoll, request() only records what a socket wants;
+   * the resulting submissions are queued right before the next wait(), and
+   * that wait() submits them together with waiting for completions in one
+   * \c io_uring_enter(2). A socket that ends up wanting what it had costs
+   * nothing, and a wait() that neither submits nor blocks just reads the
+   * completion queue, without a system call.
+   *
+   * Level-triggered sockets use one-shot polls. A poll completes as soon as
+   * the socket is ready, so one that is re-armed while data is still
+   * pending reports it again, just as \c epoll(7) would. Edge-triggered
+   * sockets use a single multishot poll for all events; request() then
+   * merely filters what is reported, exactly as in detail::epoll.
+   *
+   * Every poll carries a tag that is made of the socket's slot in a table
+   * and a generation count, so completions for a socket that has been
+   * destroyed or re-armed since are recognized and dropped. A destroyed
+   * socket cancels its poll with the next submission. Completions that
+   * arrive for a socket whose last event hasn't been delivered yet are
+   * merged into that event, so every socket knows where its one pending
+   * event is, and forgetting a socket costs the same no matter how large
+   * the batch is.
+   *
+   * The ring also runs completion-based operations: read(), write(), and
+   * accept() queue a request whose completion handler is called with the
+   * result by complete(). Like interest changes, they are submitted in one
+   * go by wait() or submit(). An io_uring object that is used only for
+   * operations can be registered in another demultiplexer through
+   * as_native_socket_t(); it becomes readable when completions are pending.
+   * receive() doesn't take a buffer; the kernel picks one from a
+   * buffer_ring when data arrives, so an idle socket ties up no memory.
+   *
+   * The ring is driven by raw system calls; liburing isn't required. It
+   * needs Linux 5.13 or later: \c IORING_FEAT_EXT_ARG for timeouts in
+   * io_uring_enter(2), and multishot polls.
+   *
+   * \sa http://kernel.dk/io_uring.pdf
+   */
+  class io_uring : private boost::noncopyable
+  {
+  public:
+    class socket : public system_socket
+    {
+    public:
+      enum event_set
+        { no_events   = 0
+        , readable    = POLLIN
+        , writable    = POLLOUT
+        , pridata     = POLLPRI
+        , hangup      = POLLHUP
+        , error       = POLLERR
+        , read_hangup = POLLRDHUP
+        };
+
+      friend inline event_set & operator|= (event_set & lhs, event_set rhs) { return lhs = (event_set)((int)(lhs) | (int)(rhs)); }
+      friend inline event_set   operator|  (event_set   lhs, event_set rhs) { return lhs |= rhs; }
+      friend inline event_set & operator&= (event_set & lhs, event_set rhs) { return lhs = (event_set)((int)(lhs) & (int)(rhs)); }
+      friend inline event_set   operator&  (event_set   lhs, event_set rhs) { return lhs &= rhs; }
+      friend inline std::ostream & operator<< (std::ostream & os, event_set ev)
+      {
+        if (ev == no_events)  os << "None";
+        if (ev & readable)    os << "Read";
+        if (ev & writable)    os << "Write";
+        if (ev & pridata)     os << "Pridata";
+        if (ev & hangup)      os << "Hangup";
+        if (ev & error)       os << "Error";
+        if (ev & read_hangup) os << "ReadHangup";
+        return os;
+      }
+
+      enum trigger_type { level_triggered, edge_triggered };
+
+      socket(io_uring & demux, native_socket_t sock, event_set ev = no_events, trigger_type trigger = level_triggered)
+      : system_socket(sock), _ring(demux), _trigger(trigger), _wanted(ev), _armed(no_events), _ready(no_events)
+      , _tag(0u), _slot(0u), _event(unqueued()), _queued(unqueued()), _dirty(unqueued())
+      {
+        BOOST_ASSERT(sock >= 0);
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "register socket " << as_native_socket_t() << " events " << ev << (trigger == edge_triggered ? " edge-triggered" : ""));
+        _slot = _ring.admit(this);
+        if (trigger == edge_triggered || ev != no_events) _ring.mark_dirty(this);
+      }
+
+      ~socket()
+      {
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "unregister " << *this);
+        _ring.forget(this);
+      }
+
+      void request(event_set ev)
+      {
+        LOGXX_MSG_TRACE(context().LOGXX_SCOPE_NAME, "socket " << as_native_socket_t() << " wants events " << ev);
+        if (_trigger == edge_triggered)
+        {
+          if ((ev & _ready) && _queued == unqueued())
+            enqueue(_ring._ready_sockets, &socket::_queued, this);
+        }
+        else if (ev != _wanted)
+          _ring.mark_dirty(this);
+        _wanted = ev;
+      }
+
+    protected:
+      io_uring & context() { return _ring; }
+
+    private:
+      friend class io_uring;
+
+      event_set take(event_set ev)
+      {
+        if (_trigger == level_triggered) return ev;
+        _ready |= ev;
+        ev = _ready & (_wanted | hangup | error);
+        _ready = static_cast<event_set>(_ready & ~ev);
+        return ev;
+      }
+
+      event_set interest() const
+      {
+        return _trigger == edge_triggered ? readable | writable | pridata | read_hangup : _wanted;
+      }
+
+      io_uring &        _ring;
+      trigger_type      _trigger;
+      event_set         _wanted;
+      event_set         _armed;         // what the poll in flight waits for
+      event_set         _ready;         // edge-triggered only: edges seen but not reported yet
+      boost::uint64_t   _tag;           // of the poll in flight, 0 if there is none
+      boost::uint32_t   _slot;
+      size_t            _event;         // entry in io_uring::_events, if it hasn't been delivered
+      size_t            _queued;        // index in io_uring::_ready_sockets or unqueued()
+      size_t            _dirty;         // index in io_uring::_dirty_sockets or unqueued()
+    };
+
+    static milliseconds_t max_timeout()
+    {
+      return static_cast<milliseconds_t>(std::numeric_limits<int>::max());
+    }
+
+    explicit io_uring(unsigned int entries = 256u) : _n_events(0u), _current(0u), _unsubmitted(0u), _generation(0u), _next_completion(0u)
+    {
+      io_uring_params p;
+      std::memset(&p, 0, sizeof(p));
+      _ring_fd = throw_errno_if_minus1("io_uring_setup(2)", boost::bind(boost::type<int>(), &io_uring::setup, entries, &p));
+      LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.io_uring(" + detail::show(_ring_fd) + ')');
+      try
+      {
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+          throw system_error(ENOSYS, "io_uring_setup(2) lacks IORING_FEAT_SINGLE_MMAP or IORING_FEAT_EXT_ARG");
+        _ring_size = std::max( p.sq_off.array + p.sq_entries * sizeof(boost::uint32_t)
+                             , p.cq_off.cqes  + p.cq_entries * sizeof(io_uring_cqe)
+                             );
+        _ring = map(_ring_size, IORING_OFF_SQ_RING);
+        _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        try { _sqes = static_cast<io_uring_sqe *>(map(_sqes_size, IORING_OFF_SQES)); }
+        catch(...) { ::munmap(_ring, _ring_size); throw; }
+      }
+      catch(...)
+      {
+        ::close(_ring_fd);
+        throw;
+      }
+      char * const r( static_cast<char *>(_ring) );
+      _sq_head  = reinterpret_cast<boost::uint32_t *>(r + p.sq_off.head);
+      _sq_tail  = reinterpret_cast<boost::uint32_t *>(r + p.sq_off.tail);
+      _sq_mask  = *reinterpret_cast<boost::uint32_t *>(r + p.sq_off.ring_mask);
+      _sq_array = reinterpret_cast<boost::uint32_t *>(r + p.sq_off.array);
+      _sq_entries = p.sq_entries;
+      _cq_head  = reinterpret_cast<boost::uint32_t *>(r + p.cq_off.head);
+      _cq_tail  = reinterpret_cast<boost::uint32_t *>(r + p.cq_off.tail);
+      _cq_mask  = *reinterpret_cast<boost::uint32_t *>(r + p.cq_off.ring_mask);
+      _cqes     = reinterpret_cast<io_uring_cqe *>(r + p.cq_off.cqes);
+      _events.resize(p.cq_entries);
+    }
+
+    ~io_uring()
+    {
+      ::munmap(_sqes, _sqes_size);
+      ::munmap(_ring, _ring_size);
+      throw_errno_if_minus1("close io_uring socket", boost::bind(boost::type<int>(), &::close, _ring_fd));
+    }
+
+    bool empty() const { return _n_events == 0u && _ready_sockets.empty(); }
+
+    bool pop_event(native_socket_t & sock, socket::event_set & ev)
+    {
+      socket * s;
+      if (!pop_event(s, ev)) return false;
+      sock = s->as_native_socket_t();
+      return true;
+    }
+
+    /**
+     * Like pop_event() above, but report the socket object itself.
+     */
+    bool pop_event(socket * & sock, socket::event_set & ev)
+    {
+      LOGXX_TRACE("pop_event() has " << _n_events << " events and " << _ready_sockets.size() << " ready sockets to deliver");
+      for (; _n_events; --_n_events, ++_current)
+      {
+        sock = _events[_current].sock;
+        if (!sock) continue;
+        ev   = sock->take(_events[_current].ev);
+        if (ev == socket::no_events) continue;
+        --_n_events; ++_current;
+        LOGXX_TRACE("deliver events " << ev << " on socket " << sock->as_native_socket_t());
+        return true;
+      }
+      while (!_ready_sockets.empty())
+      {
+        sock = _ready_sockets.back();
+        _ready_sockets.pop_back();
+        sock->_queued = unqueued();
+        ev = sock->take(socket::no_events);
+        if (ev == socket::no_events) continue;
+        LOGXX_TRACE("deliver remembered events " << ev << " on socket " << sock->as_native_socket_t());
+        return true;
+      }
+      return false;
+    }
+
+    void wait(milliseconds_t timeout)
+    {
+      BOOST_ASSERT(timeout <= max_timeout());
+      BOOST_ASSERT(!_n_events);
+      while (!_removals.empty())
+      {
+        cancel(_removals.back());
+        _removals.pop_back();
+      }
+      while (!_dirty_sockets.empty())
+      {
+        socket * const s( _dirty_sockets.back() );
+        _dirty_sockets.pop_back();
+        flush(*s);
+      }
+      bool const block( timeout != 0u && !completions() );
+      if (!block && !_unsubmitted) return reap();       // nothing for the kernel to do
+      __kernel_timespec ts;
+      ts.tv_sec  = timeout / 1000u;
+      ts.tv_nsec = static_cast<long long>(timeout % 1000u) * 1000000ll;
+      sigset_t unblock_all;
+      throw_errno_if_minus1("sigemptyset(3)", boost::bind(boost::type<int>(), &::sigemptyset, &unblock_all));
+      io_uring_getevents_arg arg;
+      std::memset(&arg, 0, sizeof(arg));
+      arg.sigmask    = reinterpret_cast<boost::uint64_t>(&unblock_all);
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts         = reinterpret_cast<boost::uint64_t>(&ts);
+      LOGXX_TRACE("submit " << _unsubmitted << " requests" << (block ? " and wait" : ""));
+      int const rc( enter( _ring_fd, _unsubmitted, block ? 1u : 0u
+                         , block ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0u
+                         , block ? &arg : 0, block ? sizeof(arg) : 0u
+                         ));
+      LOGXX_TRACE("wait() returned " << rc);
+      if (rc < 0)
+      {
+        if (errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN)
+        {
+          system_error err(errno, "io_uring_enter(2)");
+          throw err;
+        }
+      }
+      else
+        _unsubmitted -= std::min(_unsubmitted, static_cast<unsigned int>(rc));
+      reap();
+    }
+
+    /**
+     * Called with the result of an operation: the number of bytes
+     * transferred, the accepted socket, or a negated \c errno value.
+     */
+    typedef boost::function1<void, int> completion;
+
+    /**
+     * Called with the result of a receive() and the buffer the kernel has
+     * filled, or 0 if it used none. The buffer goes back into its ring when
+     * the handler returns.
+     */
+    typedef boost::function2<void, int, char *> receive_completion;
+
+    /**
+     * The buffers of a ioxx::buffer_pool, handed to the kernel for
+     * receive(). All buffers must be available when the ring is created;
+     * they return to the pool when it's destroyed. The ring must not be
+     * destroyed while receive() operations on it are pending. Needs Linux
+     * 5.19 or later.
+     */
+    class buffer_ring : private boost::noncopyable
+    {
+    public:
+      buffer_ring(io_uring & ring, buffer_pool & pool, boost::uint16_t group)
+      : _uring(ring), _pool(pool), _group(group), _entries(1u), _tail(0u)
+      {
+        BOOST_ASSERT(pool.available() == pool.size());
+        if (pool.size() > 32768u) throw std::invalid_argument("an io_uring buffer ring holds at most 32768 buffers");
+        while (_entries < pool.size()) _entries <<= 1;
+        _size = _entries * sizeof(io_uring_buf);
+        void * const p( ::mmap(0, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0) );
+        if (p == MAP_FAILED) throw system_error(errno, "mmap io_uring buffer ring");
+        _bufs = static_cast<io_uring_buf *>(p);
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr    = reinterpret_cast<boost::uint64_t>(p);
+        reg.ring_entries = _entries;
+        reg.bgid         = group;
+        if (control(_uring._ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1u) < 0)
+        {
+          system_error err(errno, "register io_uring buffer ring");
+          ::munmap(p, _size);
+          throw err;
+        }
+        for (char * b( pool.acquire() ); b; b = pool.acquire())
+          add(b);
+        publish();
+      }
+
+      ~buffer_ring()
+      {
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.bgid = _group;
+        control(_uring._ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1u);
+        ::munmap(_bufs, _size);
+        for (size_t i(0u); i != _pool.size(); ++i)
+          _pool.release(_pool.buffer(i));
+      }
+
+      boost::uint16_t   group() const   { return _group; }
+      buffer_pool &     pool()          { return _pool; }
+
+    private:
+      friend class io_uring;
+
+      void recycle(char * b)
+      {
+        add(b);
+        publish();
+      }
+
+      void add(char * b)
+      {
+        io_uring_buf & e( _bufs[_tail & (_entries - 1u)] );     // leaves resv alone: the tail lives there
+        e.addr = reinterpret_cast<boost::uint64_t>(b);
+        e.len  = static_cast<boost::uint32_t>(_pool.buffer_size());
+        e.bid  = static_cast<boost::uint16_t>(_pool.index(b));
+        ++_tail;
+      }
+
+      void publish()
+      {
+        __sync_synchronize();
+        *const_cast<boost::uint16_t volatile *>(&_bufs[0].resv) = _tail;
+      }
+
+      io_uring &        _uring;
+      buffer_pool &     _pool;
+      boost::uint16_t   _group;
+      boost::uint32_t   _entries;
+      boost::uint16_t   _tail;
+      size_t            _size;
+      io_uring_buf *    _bufs;
+    };
+
+    /**
+     * Queue a read from \c s into a buffer of \c r that the kernel picks
+     * when data arrives. The handler sees \c -ENOBUFS if the ring has run
+     * dry.
+     */
+    void receive(native_socket_t s, buffer_ring & r, receive_completion const & f)
+    {
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode    = IORING_OP_READ;
+      sqe.fd        = s;
+      sqe.off       = ~static_cast<boost::uint64_t>(0u);
+      sqe.len       = static_cast<boost::uint32_t>(r.pool().buffer_size());
+      sqe.flags     = IOSQE_BUFFER_SELECT;
+      sqe.buf_group = r.group();
+      start(sqe, operation(f, &r));
+    }
+
+    /**
+     * Queue a read from \c s into <code>[begin, end)</code>. The buffer must
+     * remain valid until \c f has run; a result of 0 means end of input.
+     */
+    void read(native_socket_t s, char * begin, char * end, completion const & f)
+    {
+      BOOST_ASSERT(begin <= end);
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode    = IORING_OP_READ;
+      sqe.fd        = s;
+      sqe.off       = ~static_cast<boost::uint64_t>(0u);    // current position
+      sqe.addr      = reinterpret_cast<boost::uint64_t>(begin);
+      sqe.len       = static_cast<boost::uint32_t>(end - begin);
+      start(sqe, operation(f));
+    }
+
+    /**
+     * Queue a write of <code>[begin, end)</code> to \c s. The buffer must
+     * remain valid until \c f has run.
+     */
+    void write(native_socket_t s, char const * begin, char const * end, completion const & f)
+    {
+      BOOST_ASSERT(begin <= end);
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode    = IORING_OP_WRITE;
+      sqe.fd        = s;
+      sqe.off       = ~static_cast<boost::uint64_t>(0u);
+      sqe.addr      = reinterpret_cast<boost::uint64_t>(begin);
+      sqe.len       = static_cast<boost::uint32_t>(end - begin);
+      start(sqe, operation(f));
+    }
+
+    /**
+     * Queue the acceptance of one connection on the listening socket \c s.
+     * The new socket is in non-blocking mode.
+     */
+    void accept(native_socket_t s, completion const & f)
+    {
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode       = IORING_OP_ACCEPT;
+      sqe.fd           = s;
+      sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      start(sqe, operation(f));
+    }
+
+    /**
+     * Cancel all operations on \c s; their handlers see \c -ECANCELED. The
+     * request is submitted right away, so \c s may be closed afterwards.
+     * Needs Linux 5.19 or later, see cancels_by_fd(); older kernels reject
+     * the request and complete the operations as usual.
+     */
+    void cancel_operations(native_socket_t s)
+    {
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode       = IORING_OP_ASYNC_CANCEL;
+      sqe.fd           = s;
+      sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe.user_data    = 0u;
+      push_sqe();
+      submit();
+    }
+
+    /**
+     * Whether the kernel supports cancel_operations(), which came with Linux
+     * 5.19. The answer takes a cancellation request that finds nothing to
+     * cancel, so ask before the first request is queued.
+     */
+    bool cancels_by_fd()
+    {
+      BOOST_ASSERT(!_unsubmitted && idle() && !completions());
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode       = IORING_OP_ASYNC_CANCEL;
+      sqe.fd           = _ring_fd;              // runs no operations
+      sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe.user_data    = 0u;
+      push_sqe();
+      int const rc( throw_errno_if_minus1("io_uring_enter(2)", boost::bind(boost::type<int>(), &io_uring::enter, _ring_fd, _unsubmitted, 1u, static_cast<unsigned int>(IORING_ENTER_GETEVENTS), static_cast<void const *>(0), 0u)) );
+      _unsubmitted -= std::min(_unsubmitted, static_cast<unsigned int>(rc));
+      boost::uint32_t const head( *_cq_head );
+      BOOST_ASSERT(load_acquire(_cq_tail) != head);
+      int const res( _cqes[head & _cq_mask].res );
+      store_release(_cq_head, head + 1u);
+      LOGXX_TRACE("cancellation by file descriptor returned " << res);
+      return res != -EINVAL;                    // older kernels reject the flags
+    }
+
+    /**
+     * Hand all queued requests to the kernel without waiting.
+     */
+    void submit()
+    {
+      if (!_unsubmitted) return;
+      LOGXX_TRACE("submit " << _unsubmitted << " requests");
+      int const rc( throw_errno_if_minus1("io_uring_enter(2)", boost::bind(boost::type<int>(), &io_uring::enter, _ring_fd, _unsubmitted, 0u, 0u, static_cast<void const *>(0), 0u)) );
+      _unsubmitted -= std::min(_unsubmitted, static_cast<unsigned int>(rc));
+    }
+
+    /**
+     * Run the handlers of at most \c max_work completed operations.
+     *
+     * \return The number of handlers that ran.
+     */
+    size_t complete(size_t max_work = std::numeric_limits<size_t>::max())
+    {
+      reap();
+      size_t n( 0u );
+      for (; n != max_work && _next_completion != _completions.size(); ++n)
+      {
+        result const c( _completions[_next_completion++] );
+        if (_next_completion == _completions.size())
+        {
+          _completions.clear();
+          _next_completion = 0u;
+        }
+        operation op;
+        op.swap(_operations[c.index]);
+        _free_operations.push_back(c.index);
+        if (!op.ring)
+        {
+          op.done(c.result);
+          continue;
+        }
+        char * const b( c.flags & IORING_CQE_F_BUFFER ? op.ring->_pool.buffer(c.flags >> IORING_CQE_BUFFER_SHIFT) : 0 );
+        recycle_guard const guard(op.ring, b);
+        op.received(c.result, b);
+      }
+      return n;
+    }
+
+    /// Whether complete() has handlers to run.
+    bool completed() const { return _next_completion != _completions.size() || completions(); }
+
+    /// Whether no operation is pending.
+    bool idle() const { return _operations.size() == _free_operations.size(); }
+
+    native_socket_t as_native_socket_t() const { return _ring_fd; }
+
+  protected:
+    LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
+
+  private:
+    struct ready_event
+    {
+      socket *                  sock;
+      socket::event_set         ev;
+    };
+
+    native_socket_t             _ring_fd;
+    void *                      _ring;
+    size_t                      _ring_size;
+    io_uring_sqe *              _sqes;
+    size_t                      _sqes_size;
+    boost::uint32_t *           _sq_head;
+    boost::uint32_t *           _sq_tail;
+    boost::uint32_t             _sq_mask;
+    boost::uint32_t *           _sq_array;
+    boost::uint32_t             _sq_entries;
+    boost::uint32_t *           _cq_head;
+    boost::uint32_t *           _cq_tail;
+    boost::uint32_t             _cq_mask;
+    io_uring_cqe *              _cqes;
+    std::vector<ready_event>    _events;
+    size_t                      _n_events;
+    size_t                      _current;
+    unsigned int                _unsubmitted;
+    boost::uint32_t             _generation;
+    std::vector<socket *>       _slots;                 // socket of every tag
+    std::vector<boost::uint32_t> _free_slots;
+    std::vector<socket *>       _ready_sockets;         // edge-triggered sockets with remembered events
+    std::vector<socket *>       _dirty_sockets;         // sockets whose poll must change
+    std::vector<boost::uint64_t> _removals;             // polls of destroyed sockets; wait() cancels them
+    struct operation
+    {
+      operation() : ring(0) { }
+      explicit operation(completion const & f) : done(f), ring(0) { }
+      operation(receive_completion const & f, buffer_ring * r) : received(f), ring(r) { }
+
+      void swap(operation & other)
+      {
+        done.swap(other.done);
+        received.swap(other.received);
+        std::swap(ring, other.ring);
+      }
+
+      completion                done;
+      receive_completion        received;
+      buffer_ring *             ring;           // of a receive()
+    };
+
+    struct result
+    {
+      boost::uint32_t           index;
+      int                       result;
+      boost::uint32_t           flags;
+    };
+
+    // Puts a buffer back into its ring even if the handler throws.
+    struct recycle_guard
+    {
+      recycle_guard(buffer_ring * r, char * b) : ring(r), buffer(b) { }
+      ~recycle_guard() { if (buffer) ring->recycle(buffer); }
+
+      buffer_ring *             ring;
+      char *                    buffer;
+    };
+
+    std::vector<operation>      _operations;            // of every operation tag
+    std::vector<boost::uint32_t> _free_operations;
+    std::vector<result>         _completions;
+    size_t                      _next_completion;
+
+    // Tags of operations have the top bit set; those of polls don't.
+    static boost::uint64_t const operation_tag = static_cast<boost::uint64_t>(1u) << 63;
+
+    // There are no libc wrappers for these system calls.
+
+    static int setup(unsigned int entries, io_uring_params * p)
+    {
+      return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    static int enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void const * arg, size_t argsz)
+    {
+      return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+    }
+
+    static int control(int fd, unsigned int opcode, void * arg, unsigned int nr_args)
+    {
+      return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    void * map(size_t size, off_t offset)
+    {
+      void * const p( ::mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, offset) );
+      if (p == MAP_FAILED) throw system_error(errno, "mmap io_uring");
+      return p;
+    }
+
+    static boost::uint32_t load_acquire(boost::uint32_t const * p)
+    {
+      boost::uint32_t const v( *const_cast<boost::uint32_t const volatile *>(p) );
+      __sync_synchronize();
+      return v;
+    }
+
+    static void store_release(boost::uint32_t * p, boost::uint32_t v)
+    {
+      __sync_synchronize();
+      *const_cast<boost::uint32_t volatile *>(p) = v;
+    }
+
+    bool completions() const
+    {
+      return load_acquire(_cq_tail) != *_cq_head;
+    }
+
+    boost::uint32_t admit(socket * s)
+    {
+      _removals.reserve(_removals.size() + _slots.size() - _free_slots.size() + 1u);    // forget() must not fail
+      if (!_free_slots.empty())
+      {
+        boost::uint32_t const i( _free_slots.back() );
+        _free_slots.pop_back();
+        _slots[i] = s;
+        return i;
+      }
+      BOOST_ASSERT(_slots.size() < std::numeric_limits<boost::uint32_t>::max());
+      _slots.push_back(s);
+      _free_slots.reserve(_slots.size());       // forget() must not fail
+      return static_cast<boost::uint32_t>(_slots.size() - 1u);
+    }
+
+    void mark_dirty(socket * s)
+    {
+      if (s->_dirty == unqueued()) enqueue(_dirty_sockets, &socket::_dirty, s);
+    }
+
+    /**
+     * Drop the queued events of a socket that's going away, and queue the
+     * removal of its poll for the next wait(). Queueing the removal right
+     * away might have to submit a full queue, which can fail, and this runs
+     * in the socket's destructor.
+     */
+    void forget(socket * s)
+    {
+      if (ready_event * const e = pending_event(s)) e->sock = 0;
+      if (s->_queued != unqueued()) unqueue(_ready_sockets, &socket::_queued, s);
+      if (s->_dirty != unqueued())  unqueue(_dirty_sockets, &socket::_dirty, s);
+      if (s->_tag) _removals.push_back(s->_tag);
+      _slots[s->_slot] = 0;
+      _free_slots.push_back(s->_slot);
+    }
+
+    /**
+     * The event of \c s that reap() has queued and pop_event() hasn't
+     * delivered yet, if there is one.
+     */
+    ready_event * pending_event(socket const * s)
+    {
+      size_t const i( s->_event );
+      return i >= _current && i < _current + _n_events && _events[i].sock == s ? &_events[i] : 0;
+    }
+
+    static size_t unqueued() { return std::numeric_limits<size_t>::max(); }
+
+    static void enqueue(std::vector<socket *> & q, size_t socket::* pos, socket * s)
+    {
+      s->*pos = q.size();
+      q.push_back(s);
+    }
+
+    /**
+     * Remove \c s from \c q in constant time; the last socket in the queue
+     * takes its place.
+     */
+    static void unqueue(std::vector<socket *> & q, size_t socket::* pos, socket * s)
+    {
+      BOOST_ASSERT(s->*pos < q.size() && q[s->*pos] == s);
+      socket * const last( q.back() );
+      q[s->*pos] = last;
+      last->*pos = s->*pos;
+      q.pop_back();
+      s->*pos = unqueued();
+    }
+
+    /**
+     * Bring the poll of \c s in line with what it wants.
+     */
+    void flush(socket & s)
+    {
+      s._dirty = unqueued();
+      socket::event_set const ev( s.interest() );
+      if (s._tag && s._armed == ev) return;
+      if (s._tag) cancel(s._tag);
+      s._tag   = 0u;
+      s._armed = socket::no_events;
+      if (ev == socket::no_events) return;
+      if (++_generation == 0x80000000u) _generation = 1u;
+      boost::uint64_t const tag( static_cast<boost::uint64_t>(_generation) << 32 | s._slot );
+      LOGXX_TRACE("poll socket " << s.as_native_socket_t() << " for " << ev << (s._trigger == socket::edge_triggered ? " multishot" : ""));
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode        = IORING_OP_POLL_ADD;
+      sqe.fd            = s.as_native_socket_t();
+      sqe.poll32_events = static_cast<boost::uint32_t>(ev);
+      sqe.len           = s._trigger == socket::edge_triggered ? IORING_POLL_ADD_MULTI : 0u;
+      sqe.user_data     = tag;
+      push_sqe();
+      s._tag   = tag;
+      s._armed = ev;
+    }
+
+    void start(io_uring_sqe & sqe, operation const & op)
+    {
+      boost::uint32_t i;
+      if (!_free_operations.empty())
+      {
+        i = _free_operations.back();
+        _free_operations.pop_back();
+        _operations[i] = op;
+      }
+      else
+      {
+        i = static_cast<boost::uint32_t>(_operations.size());
+        _operations.push_back(op);
+        _free_operations.reserve(_operations.size());   // complete() must not fail
+      }
+      sqe.user_data = operation_tag | i;
+      push_sqe();
+    }
+
+    void cancel(boost::uint64_t tag)
+    {
+      io_uring_sqe & sqe( next_sqe() );
+      sqe.opcode    = IORING_OP_POLL_REMOVE;
+      sqe.fd        = -1;
+      sqe.addr      = tag;
+      sqe.user_data = 0u;                       // completion is ignored
+      push_sqe();
+    }
+
+    /**
+     * Return the next free submission queue entry, cleared. If the queue is
+     * full, the entries in it are submitted first.
+     */
+    io_uring_sqe & next_sqe()
+    {
+      boost::uint32_t const tail( *_sq_tail );
+      if (tail - load_acquire(_sq_head) == _sq_entries)
+      {
+        int const rc( throw_errno_if_minus1("io_uring_enter(2)", boost::bind(boost::type<int>(), &io_uring::enter, _ring_fd, _unsubmitted, 0u, 0u, static_cast<void const *>(0), 0u)) );
+        _unsubmitted -= std::min(_unsubmitted, static_cast<unsigned int>(rc));
+      }
+      io_uring_sqe & sqe( _sqes[tail & _sq_mask] );
+      std::memset(&sqe, 0, sizeof(sqe));
+      return sqe;
+    }
+
+    void push_sqe()
+    {
+      boost::uint32_t const tail( *_sq_tail );
+      _sq_array[tail & _sq_mask] = tail & _sq_mask;
+      store_release(_sq_tail, tail + 1u);
+      ++_unsubmitted;
+    }
+
+    /**
+     * Move poll completions into the event array, as far as it has room, and
+     * the results of operations into the completion queue.
+     */
+    void reap()
+    {
+      if (!_n_events) _current = 0u;
+      boost::uint32_t head( *_cq_head );
+      boost::uint32_t const tail( load_acquire(_cq_tail) );
+      for (; head != tail; ++head)
+      {
+        io_uring_cqe const & cqe( _cqes[head & _cq_mask] );
+        if (!cqe.user_data) continue;
+        if (cqe.user_data & operation_tag)
+        {
+          result const c = { static_cast<boost::uint32_t>(cqe.user_data), cqe.res, cqe.flags };
+          _completions.push_back(c);
+          continue;
+        }
+        if (_current + _n_events == _events.size()) break;
+        boost::uint32_t const slot( static_cast<boost::uint32_t>(cqe.user_data) );
+        socket * const s( slot < _slots.size() ? _slots[slot] : 0 );
+        if (!s || s->_tag != cqe.user_data) continue;   // stale
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+          s->_tag   = 0u;
+          s->_armed = socket::no_events;
+          if (s->interest() != socket::no_events) mark_dirty(s);
+        }
+        if (cqe.res == -ECANCELED) continue;
+        socket::event_set const ev( cqe.res < 0 ? socket::error : normalize(static_cast<boost::uint32_t>(cqe.res)) );
+        if (ev == socket::no_events) continue;
+        if (ready_event * const e = pending_event(s))
+        {
+          e->ev |= ev;                                  // a multishot poll completed again
+          continue;
+        }
+        s->_event = _current + _n_events++;
+        ready_event & e( _events[s->_event] );
+        e.sock = s;
+        e.ev   = ev;
+      }
+      store_release(_cq_head, head);
+      LOGXX_TRACE("reaped " << _n_events << " events");
+    }
+
+    static socket::event_set normalize(boost::uint32_t events)
+    {
+      socket::event_set ev( static_cast<socket::event_set>(events) );
+      ev |= ev & POLLRDNORM ? socket::readable : socket::no_events; // weird, redundant extensions
+      ev |= ev & POLLRDBAND ? socket::pridata  : socket::no_events;
+      ev |= ev & POLLWRNORM ? socket::writable : socket::no_events;
+      ev |= ev & POLLNVAL   ? socket::error    : socket::no_events;
+      ev &= socket::readable | socket::writable | socket::pridata | socket::hangup | socket::error | socket::read_hangup;
+      return ev;
+    }
+  };
+
+}} // namespace ioxx::detail
+
+#endif // IOXX_DETAIL_IO_URING_HPP_INCLUDED_2010_02_23
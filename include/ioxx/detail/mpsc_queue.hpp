@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_DETAIL_MPSC_QUEUE_HPP_INCLUDED_2010_02_23
+#define IOXX_DETAIL_MPSC_QUEUE_HPP_INCLUDED_2010_02_23
+
+#include <boost/noncopyable.hpp>
+#include <boost/assert.hpp>
+#include <memory>
+#include <new>
+
+namespace ioxx { namespace detail
+{
+  /**
+   * \internal
+   *
+   * \brief A lock-free queue with many producers and one consumer.
+   *
+   * Producers push onto a singly-linked stack with compare-and-swap. The
+   * consumer detaches the whole stack with one atomic exchange, reverses it
+   * into first-in-first-out order, and then pops from that private list
+   * without any synchronization at all. Neither side ever waits for the
+   * other.
+   *
+   * push() may be called from any thread; all other member functions belong
+   * to the consumer. Nodes are allocated with \c std::allocator, because
+   * the allocator of an ioxx::core need not be thread-safe. The atomic
+   * operations are GCC's \c __sync builtins.
+   */
+  template <class T>
+  class mpsc_queue : private boost::noncopyable
+  {
+  public:
+    mpsc_queue() : _shared(0), _private(0)
+    {
+    }
+
+    ~mpsc_queue()
+    {
+      release(_private);
+      release(__sync_lock_test_and_set(&_shared, static_cast<node *>(0)));
+    }
+
+    /**
+     * Append \c v to the queue.
+     *
+     * \return \c true if the queue had been drained before, i.e. if the
+     *         consumer needs to be woken up.
+     */
+    bool push(T const & v)
+    {
+      node * const n( _alloc.allocate(1u) );
+      try { new (&n->value) T(v); }
+      catch(...) { _alloc.deallocate(n, 1u); throw; }
+      node * head;
+      do
+      {
+        head = _shared;
+        n->next = head;
+      }
+      while (!__sync_bool_compare_and_swap(&_shared, head, n));
+      return !head;
+    }
+
+    /**
+     * Move the front of the queue into \c v.
+     *
+     * \return \c false if the queue is empty.
+     */
+    bool pop(T & v)
+    {
+      if (!_private && !(_private = detach())) return false;
+      node * const n( _private );
+      _private = n->next;
+      try { v = n->value; }
+      catch(...) { n->next = _private; _private = n; throw; }
+      destroy(n);
+      return true;
+    }
+
+    bool empty() const
+    {
+      return !_private && !const_cast<node * volatile &>(_shared);
+    }
+
+  private:
+    struct node
+    {
+      T         value;
+      node *    next;
+    };
+
+    typedef std::allocator<node> allocator;
+
+    node *      _shared;        // pushed by producers, newest first
+    node *      _private;       // owned by the consumer, oldest first
+    allocator   _alloc;
+
+    node * detach()
+    {
+      node * n( __sync_lock_test_and_set(&_shared, static_cast<node *>(0)) );
+      __sync_synchronize();
+      node * fifo( 0 );
+      while (n)
+      {
+        node * const next( n->next );
+        n->next = fifo;
+        fifo = n;
+        n = next;
+      }
+      return fifo;
+    }
+
+    void destroy(node * n)
+    {
+      n->value.~T();
+      _alloc.deallocate(n, 1u);
+    }
+
+    void release(node * n)
+    {
+      while (n)
+      {
+        node * const next( n->next );
+        destroy(n);
+        n = next;
+      }
+    }
+  };
+
+}} // namespace ioxx::detail
+
+#endif // IOXX_DETAIL_MPSC_QUEUE_HPP_INCLUDED_2010_02_23
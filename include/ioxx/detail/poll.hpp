@@ -30,13 +30,17 @@
 
 namespace ioxx { namespace detail
 {
-  typedef unsigned int seconds_t;
+  typedef unsigned int milliseconds_t;
 
   /**
    * \internal
    *
    * \brief I/O demultiplexer implementation based on \c poll(2).
    *
+   * Besides the events a socket requests, \c poll(2) always reports \c
+   * hangup and \c error; an invalid descriptor shows up as \c error.
+   * \c read_hangup is reported only on platforms that have \c POLLRDHUP.
+   *
    * \sa http://www.opengroup.org/onlinepubs/009695399/functions/poll.html
    */
   template < class VectorAllocator = std::allocator<pollfd>
@@ -55,10 +59,17 @@ namespace ioxx { namespace detail
     {
     public:
       enum event_set
-        { no_events = 0
-        , readable  = POLLIN
-        , writable  = POLLOUT
-        , pridata   = POLLPRI
+        { no_events   = 0
+        , readable    = POLLIN
+        , writable    = POLLOUT
+        , pridata     = POLLPRI
+        , hangup      = POLLHUP
+        , error       = POLLERR
+#if defined POLLRDHUP
+        , read_hangup = POLLRDHUP
+#else
+        , read_hangup = 1 << 14         // never reported
+#endif
         };
 
       friend inline event_set & operator|= (event_set & lhs, event_set rhs) { return lhs = (event_set)((int)(lhs) | (int)(rhs)); }
@@ -67,10 +78,13 @@ namespace ioxx { namespace detail
       friend inline event_set   operator&  (event_set   lhs, event_set rhs) { return lhs &= rhs; }
       friend inline std::ostream & operator<< (std::ostream & os, event_set ev)
       {
-        if (ev == no_events) os << "None";
-        if (ev & readable)   os << "Read";
-        if (ev & writable)   os << "Write";
-        if (ev & pridata)    os << "Pridata";
+        if (ev == no_events)  os << "None";
+        if (ev & readable)    os << "Read";
+        if (ev & writable)    os << "Write";
+        if (ev & pridata)     os << "Pridata";
+        if (ev & hangup)      os << "Hangup";
+        if (ev & error)       os << "Error";
+        if (ev & read_hangup) os << "ReadHangup";
         return os;
       }
 
@@ -136,9 +150,9 @@ namespace ioxx { namespace detail
       }
     };
 
-    static seconds_t max_timeout()
+    static milliseconds_t max_timeout()
     {
-      return static_cast<seconds_t>(std::numeric_limits<int>::max() / 1000);
+      return static_cast<milliseconds_t>(std::numeric_limits<int>::max());
     }
 
     poll() : _n_events(0u), _current(0u)
@@ -150,7 +164,7 @@ namespace ioxx { namespace detail
 
     bool pop_event(native_socket_t & sock, typename socket::event_set & ev)
     {
-      while (_n_events)
+      while (_n_events && _current < _pfd.size())   // sockets may have gone away since wait()
       {
         LOGXX_TRACE("pop_event() has " << _n_events << " events to deliver; _current = " << _current);
         pollfd const & pfd( _pfd[_current++] );
@@ -162,20 +176,22 @@ namespace ioxx { namespace detail
         ev  |= ev & POLLRDNORM ? socket::readable : socket::no_events; // weird, redundant extensions
         ev  |= ev & POLLRDBAND ? socket::pridata  : socket::no_events;
         ev  |= ev & POLLWRNORM ? socket::writable : socket::no_events;
-        ev  &= socket::readable | socket::writable | socket::pridata;
+        ev  |= ev & POLLNVAL   ? socket::error    : socket::no_events;
+        ev  &= socket::readable | socket::writable | socket::pridata | socket::hangup | socket::error | socket::read_hangup;
         LOGXX_TRACE("deliver events " << ev << " on socket " << sock);
         return true;
       }
+      _n_events = 0u;
       return false;
     }
 
-    void wait(seconds_t timeout)
+    void wait(milliseconds_t timeout)
     {
-      LOGXX_TRACE("wait on " << _pfd.size() << " sockets for at most " << timeout << " seconds");
+      LOGXX_TRACE("wait on " << _pfd.size() << " sockets for at most " << timeout << " milliseconds");
       BOOST_ASSERT(timeout <= max_timeout());
       BOOST_ASSERT(!_n_events);
 #if defined IOXX_HAVE_PPOLL && IOXX_HAVE_PPOLL
-      timespec const to = { timeout, 0 };
+      timespec const to = { timeout / 1000u, (timeout % 1000u) * 1000000l };
       sigset_t unblock_all;
       throw_errno_if_minus1("sigemptyset(3)", boost::bind(boost::type<int>(), &::sigemptyset, &unblock_all));
       int const rc( ::ppoll(&_pfd[0], _pfd.size(), &to, &unblock_all) );
@@ -183,7 +199,7 @@ namespace ioxx { namespace detail
       int rc;
       {
         signal_unblock signal_scope;
-        rc = ::poll(&_pfd[0], _pfd.size(), static_cast<int>(timeout) * 1000);
+        rc = ::poll(&_pfd[0], _pfd.size(), static_cast<int>(timeout));
       }
 #endif
       LOGXX_TRACE("wait() returned " << rc);
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_DETAIL_PTHREAD_HPP_INCLUDED_2010_02_23
+#define IOXX_DETAIL_PTHREAD_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/error.hpp>
+#include <boost/noncopyable.hpp>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace ioxx { namespace detail
+{
+  /**
+   * \internal
+   *
+   * \brief The number of CPUs that are online, but at least one.
+   */
+  inline size_t online_cpus()
+  {
+    long const n( ::sysconf(_SC_NPROCESSORS_ONLN) );
+    return n > 0 ? static_cast<size_t>(n) : 1u;
+  }
+
+  /**
+   * \internal
+   *
+   * \brief Throw a system_error if a pthread function failed. These
+   * functions return the error code rather than setting \c errno.
+   */
+  inline void throw_if_pthread_error(int rc, char const * context)
+  {
+    if (rc != 0) throw system_error(rc, context);
+  }
+
+  /**
+   * \internal
+   *
+   * \brief A non-recursive \c pthread_mutex_t.
+   */
+  class mutex : private boost::noncopyable
+  {
+  public:
+    mutex()             { throw_if_pthread_error(pthread_mutex_init(&_mutex, 0), "pthread_mutex_init(3)"); }
+    ~mutex()            { pthread_mutex_destroy(&_mutex); }
+
+    void lock()         { throw_if_pthread_error(pthread_mutex_lock(&_mutex), "pthread_mutex_lock(3)"); }
+    void unlock()       { pthread_mutex_unlock(&_mutex); }
+
+    pthread_mutex_t & native() { return _mutex; }
+
+    class scoped_lock : private boost::noncopyable
+    {
+    public:
+      explicit scoped_lock(mutex & m) : _m(m) { _m.lock(); }
+      ~scoped_lock()                          { _m.unlock(); }
+
+    private:
+      mutex & _m;
+    };
+
+  private:
+    pthread_mutex_t _mutex;
+  };
+
+  /**
+   * \internal
+   *
+   * \brief A \c pthread_cond_t to be used with ioxx::detail::mutex.
+   */
+  class condition : private boost::noncopyable
+  {
+  public:
+    condition()         { throw_if_pthread_error(pthread_cond_init(&_cond, 0), "pthread_cond_init(3)"); }
+    ~condition()        { pthread_cond_destroy(&_cond); }
+
+    /// Release \c m, which the caller holds, and block until notified.
+    void wait(mutex & m) { throw_if_pthread_error(pthread_cond_wait(&_cond, &m.native()), "pthread_cond_wait(3)"); }
+
+    void notify_one()   { pthread_cond_signal(&_cond); }
+    void notify_all()   { pthread_cond_broadcast(&_cond); }
+
+  private:
+    pthread_cond_t _cond;
+  };
+
+}} // namespace ioxx::detail
+
+#endif // IOXX_DETAIL_PTHREAD_HPP_INCLUDED_2010_02_23
@@ -28,13 +28,19 @@
 
 namespace ioxx { namespace detail
 {
-  typedef unsigned int seconds_t;
+  typedef unsigned int milliseconds_t;
 
   /**
    * \internal
    *
    * \brief I/O demultiplexer implementation based on \c select(2).
    *
+   * \c select(2) has no notion of a hangup or an error condition: a socket
+   * in either state shows up as readable, and the next \c read(2) tells
+   * what happened. The \c hangup, \c error, and \c read_hangup events
+   * exist for compatibility with the other demultiplexers, but they are
+   * never reported.
+   *
    * \sa http://www.opengroup.org/onlinepubs/009695399/functions/select.html
    */
   class select : private boost::noncopyable
@@ -44,10 +50,13 @@ namespace ioxx { namespace detail
     {
     public:
       enum event_set
-        { no_events = 0
-        , readable  = 1 << 0
-        , writable  = 1 << 1
-        , pridata   = 1 << 2
+        { no_events   = 0
+        , readable    = 1 << 0
+        , writable    = 1 << 1
+        , pridata     = 1 << 2
+        , hangup      = 1 << 3          // never reported
+        , error       = 1 << 4          // never reported
+        , read_hangup = 1 << 5          // never reported
         };
 
       friend inline event_set & operator|= (event_set & lhs, event_set rhs) { return lhs = (event_set)((int)(lhs) | (int)(rhs)); }
@@ -56,10 +65,13 @@ namespace ioxx { namespace detail
       friend inline event_set   operator&  (event_set   lhs, event_set rhs) { return lhs &= rhs; }
       friend inline std::ostream & operator<< (std::ostream & os, event_set ev)
       {
-        if (ev == no_events) os << "None";
-        if (ev & readable)   os << "Read";
-        if (ev & writable)   os << "Write";
-        if (ev & pridata)    os << "Pridata";
+        if (ev == no_events)  os << "None";
+        if (ev & readable)    os << "Read";
+        if (ev & writable)    os << "Write";
+        if (ev & pridata)     os << "Pridata";
+        if (ev & hangup)      os << "Hangup";
+        if (ev & error)       os << "Error";
+        if (ev & read_hangup) os << "ReadHangup";
         return os;
       }
 
@@ -72,6 +84,7 @@ namespace ioxx { namespace detail
 
       ~socket()
       {
+        _select.forget(as_native_socket_t());
         request(no_events);
       }
 
@@ -81,7 +94,7 @@ namespace ioxx { namespace detail
         if (ev & readable) { FD_SET(s, &_select._req_read_fds); }   else { FD_CLR(s, &_select._req_read_fds); }
         if (ev & writable) { FD_SET(s, &_select._req_write_fds); }  else { FD_CLR(s, &_select._req_write_fds); }
         if (ev & pridata)  { FD_SET(s, &_select._req_except_fds); } else { FD_CLR(s, &_select._req_except_fds); }
-        if (ev != no_events)
+        if (ev & (readable | writable | pridata))
         {
           _select._max_fd = std::max(_select._max_fd, s);
         }
@@ -99,8 +112,6 @@ namespace ioxx { namespace detail
           }
           LOGXX_TRACE("select: new _max_fd is " << _select._max_fd);
         }
-        else
-          BOOST_ASSERT(s < _select._max_fd);
       }
 
     protected:
@@ -110,9 +121,9 @@ namespace ioxx { namespace detail
       select & _select;
     };
 
-    static seconds_t max_timeout()
+    static milliseconds_t max_timeout()
     {
-      return static_cast<seconds_t>(std::numeric_limits<int>::max());
+      return static_cast<milliseconds_t>(std::numeric_limits<int>::max());
     }
 
     select() : _max_fd(-1), _current(0), _n_events(0u)
@@ -146,19 +157,19 @@ namespace ioxx { namespace detail
       return false;
     }
 
-    void wait(seconds_t timeout)
+    void wait(milliseconds_t timeout)
     {
       BOOST_ASSERT(timeout <= max_timeout());
       BOOST_ASSERT(!_n_events);
       if (_max_fd == -1)
       {
 #if defined IOXX_HAVE_PSELECT && IOXX_HAVE_PSELECT
-        timespec const to = { timeout, 0 };
+        timespec const to = { timeout / 1000u, (timeout % 1000u) * 1000000l };
         sigset_t unblock_all;
         throw_errno_if_minus1("sigemptyset(3)", boost::bind(boost::type<int>(), &::sigemptyset, &unblock_all));
         ::pselect(0, NULL, NULL, NULL, &to, &unblock_all);
 #else
-        timeval tv = { timeout, 0 };
+        timeval tv = { timeout / 1000u, (timeout % 1000u) * 1000l };
         signal_unblock signal_scope;
         ::select(0, NULL, NULL, NULL, &tv);
 #endif
@@ -168,14 +179,14 @@ namespace ioxx { namespace detail
       _recv_write_fds  = _req_write_fds;
       _recv_except_fds = _req_except_fds;
 #if defined IOXX_HAVE_PSELECT && IOXX_HAVE_PSELECT
-      timespec const to = { timeout, 0 };
+      timespec const to = { timeout / 1000u, (timeout % 1000u) * 1000000l };
       sigset_t unblock_all;
       throw_errno_if_minus1("sigemptyset(3)", boost::bind(boost::type<int>(), &::sigemptyset, &unblock_all));
       int const rc( ::pselect(_max_fd + 1, &_recv_read_fds, &_recv_write_fds, &_recv_except_fds, &to, &unblock_all) );
 #else
       int rc;
       {
-        timeval tv = { timeout, 0 };
+        timeval tv = { timeout / 1000u, (timeout % 1000u) * 1000l };
         signal_unblock signal_scope;
         rc = ::select(_max_fd + 1, &_recv_read_fds, &_recv_write_fds, &_recv_except_fds, &tv);
       }
@@ -195,6 +206,17 @@ namespace ioxx { namespace detail
     LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
 
   private:
+    /**
+     * Drop the undelivered events of a socket that's going away.
+     */
+    void forget(native_socket_t s)
+    {
+      if (!_n_events || s < _current) return;
+      if (FD_ISSET(s, &_recv_read_fds))   { FD_CLR(s, &_recv_read_fds);   --_n_events; }
+      if (FD_ISSET(s, &_recv_write_fds))  { FD_CLR(s, &_recv_write_fds);  --_n_events; }
+      if (FD_ISSET(s, &_recv_except_fds)) { FD_CLR(s, &_recv_except_fds); --_n_events; }
+    }
+
     fd_set              _req_read_fds, _req_write_fds, _req_except_fds;
     fd_set              _recv_read_fds, _recv_write_fds, _recv_except_fds;
     native_socket_t     _max_fd;
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_DETAIL_TIMERFD_HPP_INCLUDED_2010_02_23
+#define IOXX_DETAIL_TIMERFD_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/socket.hpp>
+#include <ioxx/time.hpp>
+#include <boost/cstdint.hpp>
+#include <sys/timerfd.h>
+
+namespace ioxx { namespace detail
+{
+  /**
+   * \internal
+   *
+   * \brief A wake-up timer on the monotonic clock based on \c timerfd_create(2).
+   *
+   * The timer is an ordinary file descriptor that becomes readable when the
+   * deadline passes, so any demultiplexer reports its expiry like a socket
+   * event. Arming it with the deadline it already has costs no system call.
+   *
+   * \sa http://www.kernel.org/doc/man-pages/online/pages/man2/timerfd_create.2.html
+   */
+  class timerfd : public system_socket
+  {
+  public:
+    timerfd() : system_socket(create()), _armed(0u)
+    {
+    }
+
+    /**
+     * Return the deadline the timer is armed with, or 0 if it isn't armed.
+     */
+    monotonic_time_t armed() const { return _armed; }
+
+    /**
+     * Fire at time \c deadline of ioxx::time_of_day::current_monotonic_time().
+     * A deadline in the past fires immediately.
+     */
+    void arm(monotonic_time_t deadline)
+    {
+      BOOST_ASSERT(deadline != 0u);
+      if (deadline == _armed) return;
+      itimerspec its;
+      its.it_interval.tv_sec  = 0;
+      its.it_interval.tv_nsec = 0;
+      its.it_value.tv_sec     = static_cast<std::time_t>(deadline / 1000u);
+      its.it_value.tv_nsec    = static_cast<long>(deadline % 1000u) * 1000000l;
+      LOGXX_TRACE("arm timer for " << deadline);
+      throw_errno_if_minus1("timerfd_settime(2)", boost::bind(boost::type<int>(), &timerfd_settime, as_native_socket_t(), static_cast<int>(TFD_TIMER_ABSTIME), &its, static_cast<itimerspec *>(0)));
+      _armed = deadline;
+    }
+
+    /**
+     * Acknowledge an expiry. The timer is disarmed afterwards.
+     */
+    void expire()
+    {
+      boost::uint64_t n;
+      read(reinterpret_cast<char *>(&n), reinterpret_cast<char const *>(&n + 1));
+      _armed = 0u;
+    }
+
+  private:
+    static native_socket_t create()
+    {
+      return throw_errno_if_minus1("timerfd_create(2)", boost::bind(boost::type<int>(), &timerfd_create, CLOCK_MONOTONIC, static_cast<int>(TFD_NONBLOCK | TFD_CLOEXEC)));
+    }
+
+    monotonic_time_t _armed;
+  };
+
+}} // namespace ioxx::detail
+
+#endif // IOXX_DETAIL_TIMERFD_HPP_INCLUDED_2010_02_23
@@ -28,37 +28,164 @@
 #else
 #  error "No I/O de-multiplexer available for this platform."
 #endif
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+#  include <ioxx/detail/io_uring.hpp>
+#endif
+#include <ioxx/fd_map.hpp>
+#include <ioxx/stats.hpp>
+#include <boost/function/function0.hpp>
 #include <boost/function/function1.hpp>
+#include <boost/checked_delete.hpp>
+#include <boost/type_traits/integral_constant.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <limits>
 #include <map>
+#include <vector>
 
 namespace ioxx
 {
-  typedef unsigned int seconds_t;
+  typedef unsigned int milliseconds_t;
 
   /**
    * \internal
    *
-   * \brief A simple time-event dispatcher.
+   * How ioxx::dispatch learns which socket an event belongs to. By default,
+   * a demultiplexer reports the file descriptor, and dispatch looks up the
+   * handler in its \c HandlerMap. Demultiplexers that report the socket
+   * object itself specialize this trait; dispatch then calls the handler
+   * directly.
    */
-  template < class Allocator  = std::allocator<void>
-           , class Demux      =
+  template <class Demux>
+  struct demux_event_source
+  {
+    typedef native_socket_t type;
+  };
+
+  /**
+   * \internal
+   *
+   * Whether a demultiplexer offers pop_batch(). If it does, ioxx::dispatch
+   * delivers a whole batch of events in one loop and falls back to
+   * pop_event() only for what the batch doesn't cover.
+   */
+  template <class Demux>
+  struct demux_has_batch : boost::false_type
+  {
+  };
+
+#if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
+  template <>
+  struct demux_event_source<detail::epoll>
+  {
+    typedef detail::epoll::socket * type;
+  };
+
+  template <>
+  struct demux_has_batch<detail::epoll> : boost::true_type
+  {
+  };
+#endif
+
+  /**
+   * \internal
+   *
+   * The number of system calls a demultiplexer has made to change its
+   * interest set, for statistics. Only detail::epoll keeps count.
+   */
+  template <class Demux>
+  inline size_t demux_ctl_calls(Demux const &)
+  {
+    return 0u;
+  }
+
+#if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
+  inline size_t demux_ctl_calls(detail::epoll const & demux)
+  {
+    return demux.ctl_calls();
+  }
+#endif
+
+  /**
+   * \internal
+   *
+   * The best demultiplexer this platform has; the default of
+   * ioxx::dispatch.
+   */
+  template <class Allocator>
+  struct default_demux
+  {
 #if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
-                                detail::epoll
+    typedef detail::epoll type;
 #elif defined IOXX_HAVE_POLL && IOXX_HAVE_POLL
-                                detail::poll< typename Allocator::template rebind<pollfd>::other
-                                            , typename Allocator::template rebind< std::pair<native_socket_t const, size_t> >::other
-                                            >
+    typedef detail::poll< typename Allocator::template rebind<pollfd>::other
+                        , typename Allocator::template rebind< std::pair<native_socket_t const, size_t> >::other
+                        > type;
 #elif defined(IOXX_HAVE_SELECT) && IOXX_HAVE_SELECT
-                                detail::select
+    typedef detail::select type;
 #endif
+  };
+
+  /**
+   * \internal
+   *
+   * The default handler map of ioxx::dispatch.
+   */
+  template <class Allocator, class Handler>
+  struct default_handler_map
+  {
+#if defined __linux__
+    typedef fd_map<native_socket_t, Handler, Allocator> type;
+#else
+    typedef std::map< native_socket_t
+                    , Handler
+                    , std::less<native_socket_t>
+                    , typename Allocator::template rebind< std::pair<native_socket_t const, Handler> >::other
+                    > type;
+#endif
+  };
+
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+  template <>
+  struct demux_event_source<detail::io_uring>
+  {
+    typedef detail::io_uring::socket * type;
+  };
+#endif
+
+  /**
+   * \internal
+   *
+   * \brief A simple time-event dispatcher.
+   *
+   * On Linux, socket handlers are found through a ioxx::fd_map that is
+   * indexed by the file descriptor; elsewhere, the \c HandlerMap defaults
+   * to a \c std::map.
+   *
+   * Event handlers may destroy any socket, including their own, while run()
+   * delivers a batch of events. The handler of a socket that's destroyed
+   * during run() is kept alive until the end of run(), so a handler that
+   * holds the last reference to its connection doesn't pull the object out
+   * from under itself. The demultiplexer drops the events that are still
+   * queued for a destroyed socket, so they don't reach a new socket that
+   * re-uses its file descriptor within the same batch. Objects passed to
+   * dispose() are deleted at the end of run(), too; with that, connections
+   * can be plain objects that own their sockets and delete themselves,
+   * rather than being kept alive by \c boost::shared_ptr.
+   *
+   * The \c Stats policy decides what the dispatcher records about itself;
+   * with ioxx::loop_stats, dispatch_stats() reports the time spent in
+   * handlers and in wait(), the events delivered per wait, and the system
+   * calls spent on interest changes. The default records nothing and costs
+   * nothing.
+   */
+  template < class Allocator  = std::allocator<void>
+           , class Demux      = typename default_demux<Allocator>::type
            , class Handler    = boost::function1< void
                                                 , typename Demux::socket::event_set
                                                 >
-           , class HandlerMap = std::map< native_socket_t
-                                        , Handler
-                                        , std::less<native_socket_t>
-                                        , typename Allocator::template rebind< std::pair<native_socket_t const, Handler> >::other
-                                        >
+           , class HandlerMap = typename default_handler_map<Allocator, Handler>::type
+           , class Stats      = no_stats
            >
   class dispatch : protected Demux
   {
@@ -68,6 +195,7 @@ namespace ioxx
     typedef HandlerMap                                                                  handler_map;
     typedef typename handler_map::iterator                                              iterator;
     typedef typename demux::socket::event_set                                           event_set;
+    typedef Stats                                                                       stats;
 
     /**
      * \internal
@@ -91,15 +219,23 @@ namespace ioxx
       socket(dispatch & disp, native_socket_t sock, handler const & f = handler(), event_set ev = demux::socket::no_events)
       : demux::socket(disp, sock, ev)
       {
-        BOOST_ASSERT(this->as_native_socket_t() >= 0);
-        std::pair<iterator,bool> const r( context()._handlers.insert(std::make_pair(this->as_native_socket_t(), f)) );
-        _iter = r.first;
-        BOOST_ASSERT(r.second);
+        enter(f);
+      }
+
+      /**
+       * Register a socket with a demux-specific trigger mode, such as
+       * <code>detail::epoll::socket::edge_triggered</code>.
+       */
+      template <class Trigger>
+      socket(dispatch & disp, native_socket_t sock, handler const & f, event_set ev, Trigger trigger)
+      : demux::socket(disp, sock, ev, trigger)
+      {
+        enter(f);
       }
 
       ~socket()
       {
-        context()._handlers.erase(_iter);
+        context().retire(*this);
       }
 
       void modify(handler const & f)
@@ -117,39 +253,193 @@ namespace ioxx
       dispatch & context() { return static_cast<dispatch &>(demux::socket::context()); }
 
     private:
+      friend class dispatch;
       iterator  _iter;
+
+      void enter(handler const & f)
+      {
+        BOOST_ASSERT(this->as_native_socket_t() >= 0);
+        context().reserve_retirement();
+        std::pair<iterator,bool> const r( context()._handlers.insert(std::make_pair(this->as_native_socket_t(), f)) );
+        _iter = r.first;
+        BOOST_ASSERT(r.second);
+      }
     };
 
-    static seconds_t max_timeout() { return demux::max_timeout(); }
+    dispatch() : _running(false)
+    {
+    }
+
+    static milliseconds_t max_timeout() { return demux::max_timeout(); }
+
+    demux &       get_demux()       { return *this; }
+    demux const & get_demux() const { return *this; }
+
+    stats const & dispatch_stats() const { return _stats; }
 
     bool empty() const { return _handlers.empty(); }
 
-    void run()
+    size_t size() const { return _handlers.size(); }
+
+    /**
+     * Whether events from the last wait() are still waiting for delivery,
+     * i.e. whether the last run() exhausted its budget.
+     */
+    bool pending() const { return !demux::empty(); }
+
+    /**
+     * Deliver at most \c max_events events. Events that don't make it stay
+     * queued for the next call.
+     */
+    void run(size_t max_events = std::numeric_limits<size_t>::max())
     {
-      native_socket_t s;
+      BOOST_ASSERT(!_running);
+      batch_scope scope(*this);
+      max_events = run_batch(max_events, demux_has_batch<demux>());
+      typename demux_event_source<demux>::type s;
       event_set ev;
-      while (pop_event(s, ev))
+      for (; max_events != 0u && this->pop_event(s, ev); --max_events)
       {
-        BOOST_ASSERT(s >= 0);
         BOOST_ASSERT(ev != socket::no_events);
-        iterator const i( _handlers.find(s) );
-        if (i == _handlers.end())
-        {
-          LOGXX_MSG_TRACE(this->LOGXX_SCOPE_NAME, "ignore events; handler for socket " << s << " does no longer exist");
-          continue;
-        }
-        i->second(ev);         // this is dangerous in case of suicides
+        deliver(s, ev);
       }
     }
 
-    void wait(seconds_t timeout)
+    /**
+     * Wait for events, unless there are pending ones already.
+     */
+    void wait(milliseconds_t timeout)
     {
-      LOGXX_MSG_TRACE(this->LOGXX_SCOPE_NAME, "probe " << _handlers.size() << " sockets; time out after " << timeout << " seconds");
+      if (pending()) return;
+      LOGXX_MSG_TRACE(this->LOGXX_SCOPE_NAME, "probe " << _handlers.size() << " sockets; time out after " << timeout << " milliseconds");
+      boost::uint64_t const started( stats::now() );
       demux::wait(timeout);
+      _stats.waited(started, demux_ctl_calls(get_demux()));
+    }
+
+    /**
+     * Delete \c p at the end of the current run(), or right away if no
+     * run() is in progress.
+     */
+    template <class T>
+    void dispose(T * p)
+    {
+      if (!_running) return boost::checked_delete(p);
+      _disposals.push_back(boost::bind(&boost::checked_delete<T>, p));
     }
 
   private:
-    handler_map    _handlers;
+    typedef boost::function0<void>                                                      disposal;
+    typedef std::vector<handler, typename Allocator::template rebind<handler>::other>   handler_vector;
+    typedef std::vector<disposal, typename Allocator::template rebind<disposal>::other> disposal_vector;
+
+    struct batch_scope
+    {
+      explicit batch_scope(dispatch & disp) : _disp(disp) { _disp._running = true; }
+      ~batch_scope() { _disp._running = false; _disp.bury(); }
+      dispatch & _disp;
+    };
+
+    /**
+     * Make sure that retire() can't fail for want of memory: every socket
+     * that is alive now may be destroyed during the next run().
+     */
+    void reserve_retirement()
+    {
+      size_t const n( _graveyard.size() + _handlers.size() + 1u );
+      if (n > _graveyard.capacity()) _graveyard.reserve(std::max(n, 2u * _graveyard.capacity()));
+    }
+
+    void retire(socket & s)
+    {
+      if (_running)
+      {
+        _graveyard.push_back(handler());
+        swap(_graveyard.back(), s._iter->second);
+      }
+      _handlers.erase(s._iter);
+    }
+
+    /**
+     * Release what run() kept alive. Sockets destroyed in the process are
+     * released right away, because run() is over.
+     */
+    void bury()
+    {
+      BOOST_ASSERT(!_running);
+      _graveyard.clear();
+      for (size_t i(0u); i != _disposals.size(); ++i)
+        _disposals[i]();
+      _disposals.clear();
+    }
+
+    size_t run_batch(size_t max_events, boost::false_type)
+    {
+      return max_events;
+    }
+
+    /**
+     * Deliver a batch of events. While one handler runs, the socket of the
+     * next event and the handler of the one after that are fetched into
+     * the cache.
+     */
+    size_t run_batch(size_t max_events, boost::true_type)
+    {
+      typename demux::batch const b( this->pop_batch(max_events) );
+      size_t const n( b.size() );
+      size_t i( 0u );
+      try
+      {
+        for (; i != n; ++i)
+        {
+          if (i + 2u < n) prefetch(b.socket_at(i + 2u));
+          if (i + 1u < n && b.socket_at(i + 1u)) prefetch(&static_cast<socket *>(b.socket_at(i + 1u))->_iter->second);
+          if (typename demux::socket * const s = b.socket_at(i))
+            deliver(s, b.events_at(i));
+        }
+      }
+      catch(...)
+      {
+        this->unpop_batch(b, i + 1u);
+        throw;
+      }
+      return max_events - n;
+    }
+
+    static void prefetch(void const * p)
+    {
+#if defined __GNUC__
+      __builtin_prefetch(p);
+#endif
+    }
+
+    void deliver(native_socket_t s, event_set ev)
+    {
+      BOOST_ASSERT(s >= 0);
+      iterator const i( _handlers.find(s) );
+      if (i == _handlers.end())
+      {
+        LOGXX_MSG_TRACE(this->LOGXX_SCOPE_NAME, "ignore events; handler for socket " << s << " does no longer exist");
+        return;
+      }
+      boost::uint64_t const started( stats::now() );
+      i->second(ev);
+      _stats.handled(started);
+    }
+
+    void deliver(typename demux::socket * s, event_set ev)
+    {
+      BOOST_ASSERT(s);          // only dispatch::socket registers in our demux
+      boost::uint64_t const started( stats::now() );
+      static_cast<socket *>(s)->_iter->second(ev);
+      _stats.handled(started);
+    }
+
+    handler_map         _handlers;
+    bool                _running;
+    handler_vector      _graveyard;     // handlers of sockets destroyed during run()
+    disposal_vector     _disposals;
+    stats               _stats;
   };
 
 } // namespace ioxx
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_FD_MAP_HPP_INCLUDED_2010_02_23
+#define IOXX_FD_MAP_HPP_INCLUDED_2010_02_23
+
+#include <boost/noncopyable.hpp>
+#include <boost/assert.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace ioxx
+{
+  /**
+   * Map from file descriptors to values, indexed by the descriptor.
+   *
+   * This container can be used as the \c HandlerMap of a ioxx::dispatch in
+   * place of a \c std::map. File descriptors are small, dense integers, so
+   * the descriptor itself serves as an index into an array of slots: find()
+   * costs a shift and two loads, and insert() doesn't allocate unless the
+   * descriptor is beyond all previous ones. Slots live in blocks of 256
+   * that never move, so entries stay put when the map grows. ioxx::dispatch
+   * relies on this, because a handler may register new sockets while it is
+   * running.
+   *
+   * Memory use is proportional to the highest descriptor ever inserted, not
+   * to the number of entries. Blocks are released only when the map is
+   * destroyed.
+   *
+   * The interface is the subset of \c std::map that ioxx::dispatch relies
+   * on: insert(), erase(), find(), end(), empty(), and size(). Keys must not
+   * be negative.
+   */
+  template < class Key
+           , class T
+           , class Allocator = std::allocator<void>
+           >
+  class fd_map : private boost::noncopyable
+  {
+  public:
+    typedef Key                                 key_type;
+    typedef T                                   mapped_type;
+    typedef std::pair<Key const, T>             value_type;
+    typedef std::size_t                         size_type;
+
+  private:
+    struct slot
+    {
+      typename boost::aligned_storage< sizeof(value_type)
+                                     , boost::alignment_of<value_type>::value
+                                     >::type    storage;
+      bool                                      used;
+
+      value_type * value() { BOOST_ASSERT(used); return static_cast<value_type *>(static_cast<void *>(&storage)); }
+    };
+
+    typedef typename Allocator::template rebind<slot>::other    slot_allocator;
+    typedef typename Allocator::template rebind<slot *>::other  block_allocator;
+    typedef std::vector<slot *, block_allocator>                block_vector;
+
+  public:
+    class iterator
+    {
+    public:
+      iterator() : _slot(0) { }
+
+      value_type & operator*  () const  { BOOST_ASSERT(_slot); return *_slot->value(); }
+      value_type * operator-> () const  { BOOST_ASSERT(_slot); return _slot->value(); }
+
+      friend bool operator== (iterator const & lhs, iterator const & rhs) { return lhs._slot == rhs._slot; }
+      friend bool operator!= (iterator const & lhs, iterator const & rhs) { return lhs._slot != rhs._slot; }
+
+    private:
+      friend class fd_map;
+      explicit iterator(slot * s) : _slot(s) { }
+      slot * _slot;
+    };
+
+    fd_map() : _size(0u)
+    {
+    }
+
+    ~fd_map()
+    {
+      for (typename block_vector::iterator b( _blocks.begin() ); b != _blocks.end(); ++b)
+      {
+        if (!*b) continue;
+        for (slot * s( *b ); s != *b + slots; ++s)
+          if (s->used) s->value()->~value_type();
+        _alloc.deallocate(*b, slots);
+      }
+    }
+
+    bool      empty() const     { return _size == 0u; }
+    size_type size()  const     { return _size; }
+
+    iterator  end()   const     { return iterator(); }
+
+    iterator find(key_type const & k)
+    {
+      BOOST_ASSERT(k >= 0);
+      size_type const b( static_cast<size_type>(k) >> bits );
+      if (b >= _blocks.size() || !_blocks[b]) return end();
+      slot & s( _blocks[b][static_cast<size_type>(k) & (slots - 1u)] );
+      return s.used ? iterator(&s) : end();
+    }
+
+    /**
+     * Insert \c v unless its key is in the map already. The iterator stays
+     * valid until the entry is erased.
+     */
+    std::pair<iterator,bool> insert(value_type const & v)
+    {
+      BOOST_ASSERT(v.first >= 0);
+      slot & s( locate(static_cast<size_type>(v.first)) );
+      if (s.used) return std::make_pair(iterator(&s), false);
+      new (&s.storage) value_type(v);
+      s.used = true;
+      ++_size;
+      return std::make_pair(iterator(&s), true);
+    }
+
+    void erase(iterator i)
+    {
+      BOOST_ASSERT(i._slot);
+      BOOST_ASSERT(_size);
+      i._slot->value()->~value_type();
+      i._slot->used = false;
+      --_size;
+    }
+
+  private:
+    static unsigned int const bits  = 8u;
+    static size_type const    slots = size_type(1u) << bits;
+
+    block_vector        _blocks;
+    size_type           _size;
+    slot_allocator      _alloc;
+
+    slot & locate(size_type k)
+    {
+      size_type const b( k >> bits );
+      if (b >= _blocks.size()) _blocks.resize(b + 1u, static_cast<slot *>(0));
+      if (!_blocks[b])
+      {
+        slot * const p( _alloc.allocate(slots) );
+        for (size_type i(0u); i != slots; ++i) p[i].used = false;
+        _blocks[b] = p;
+      }
+      return _blocks[b][k & (slots - 1u)];
+    }
+  };
+
+} // namespace ioxx
+
+#endif // IOXX_FD_MAP_HPP_INCLUDED_2010_02_23
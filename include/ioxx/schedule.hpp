@@ -18,30 +18,63 @@
 #ifndef IOXX_SCHEDULE_HPP_INCLUDED_2010_02_23
 #define IOXX_SCHEDULE_HPP_INCLUDED_2010_02_23
 
+#include <ioxx/stats.hpp>
 #include <boost/function/function0.hpp>
+#include <boost/bind.hpp>
 #include <boost/noncopyable.hpp>
-#include <boost/compatibility/cpp_c_headers/ctime>
+#include <boost/cstdint.hpp>
 #include <boost/assert.hpp>
 #include <algorithm>
+#include <limits>
 #include <map>
 
 namespace ioxx
 {
-  using std::time_t;
-  typedef unsigned int seconds_t;
+  typedef unsigned int          milliseconds_t;
+  typedef boost::uint64_t       monotonic_time_t;
+
+  /**
+   * \internal
+   *
+   * \brief Tell a task queue what time it is.
+   *
+   * Ordered containers like \c std::multimap don't need to know, so this
+   * default does nothing. ioxx::timing_wheel overloads it to advance its
+   * clock.
+   */
+  template <class TaskQueue, class Time>
+  inline void advance_task_queue(TaskQueue &, Time const &)
+  {
+  }
 
   /**
    * \internal
    *
    * \brief Generic time-event dispatcher.
+   *
+   * The \c TaskQueue must provide the subset of the \c std::multimap
+   * interface that is used here: insert(), erase(), begin(), equal_range(),
+   * and empty(). ioxx::timing_wheel is a drop-in alternative to the default.
+   *
+   * Time stamps are readings of the monotonic clock in milliseconds, see
+   * ioxx::time_of_day::current_monotonic_time().
+   *
+   * Tasks may be scheduled with some \c slack: a tolerance by which they may
+   * run late. The schedule uses it to put tasks with overlapping windows on
+   * the same deadline, so that they are handled in one wakeup rather than
+   * several. coalesced() counts the wakeups saved that way.
+   *
+   * With ioxx::loop_stats as the \c Stats policy, schedule_stats() reports
+   * how late tasks ran and how long they took.
    */
   template < class Allocator = std::allocator<void>
            , class Task      = boost::function0<void>
-           , class TaskQueue = std::multimap< time_t
+           , class TaskQueue = std::multimap< monotonic_time_t
                                             , Task
-                                            , std::less<time_t>
-                                            , typename Allocator::template rebind< std::pair<time_t const, Task> >::other
+                                            , std::less<monotonic_time_t>
+                                            , typename Allocator::template rebind< std::pair<monotonic_time_t const, Task> >::other
                                             >
+           , class Stats     = no_stats
            >
   class schedule : boost::noncopyable
   {
@@ -50,76 +83,273 @@ namespace ioxx
     typedef TaskQueue                                   task_queue;
     typedef typename task_queue::iterator               queue_iterator;
     typedef typename task_queue::value_type             queue_entry;
-    typedef std::pair<time_t,queue_iterator>            task_id;
+    typedef std::pair<monotonic_time_t,queue_iterator>  task_id;
+    typedef Stats                                       stats;
 
+    /**
+     * A handle for one pending task.
+     *
+     * The handle knows whether its task is still queued, so cancelling or
+     * re-arming it never needs to search the queue: it costs one erase() and
+     * one insert(), i.e. O(1) with ioxx::timing_wheel. The queue holds a small
+     * trampoline bound to the handle rather than the task itself; \c Task must
+     * therefore be constructible from a nullary function object.
+     *
+     * Idle timeouts that are pushed back on every bit of activity should use
+     * extend(): it merely records the new deadline, and the queue entry is
+     * moved only when the old deadline comes up.
+     */
     class timeout : private boost::noncopyable
     {
     public:
-      timeout(schedule & sched) : _sched(sched), _id(task_id(static_cast<time_t>(0), queue_iterator()))
+      timeout(schedule & sched)
+      : _sched(sched), _id(static_cast<monotonic_time_t>(0), queue_iterator()), _deadline(0), _slack(0u)
       {
       }
 
-      timeout(schedule & sched, time_t ts, task const & f) : _sched(sched), _id(_sched.at(ts, f))
+      timeout(schedule & sched, monotonic_time_t ts, task const & f, milliseconds_t slack = 0u)
+      : _sched(sched), _id(static_cast<monotonic_time_t>(0), queue_iterator()), _deadline(0), _slack(0u)
       {
+        at(ts, f, slack);
       }
 
-      timeout(schedule & sched, seconds_t to, task const & f) : _sched(sched), _id(_sched.in(to, f))
+      timeout(schedule & sched, milliseconds_t to, task const & f, milliseconds_t slack = 0u)
+      : _sched(sched), _id(static_cast<monotonic_time_t>(0), queue_iterator()), _deadline(0), _slack(0u)
       {
+        in(to, f, slack);
       }
 
       ~timeout()
       {
-        _sched.cancel(_id);
+        cancel();
       }
 
       void swap(timeout & other)
       {
         BOOST_ASSERT(&other._sched == &_sched);
+        using std::swap;
         swap(other._id, _id);
+        swap(other._task, _task);
+        swap(other._deadline, _deadline);
+        swap(other._slack, _slack);
+        other.rebind();
+        rebind();
+      }
+
+      bool pending() const
+      {
+        return _id.first != 0;
       }
 
       bool cancel()
       {
-        return _sched.cancel(_id);
+        if (!pending()) return false;
+        _sched.unsafe_cancel(_id);
+        _task = task();
+        return true;
       }
 
-      bool at(time_t ts, task const & f)
+      bool at(monotonic_time_t ts, task const & f, milliseconds_t slack = 0u)
       {
-        bool const cancelled( _sched.cancel(_id) );
-        _id = _sched.at(ts, f);
+        bool const cancelled( pending() );
+        if (cancelled) _sched.unsafe_cancel(_id);
+        _task = f;
+        _id = _sched.at(ts, trampoline(), slack);
+        _deadline = ts;
+        _slack = slack;
         return cancelled;
       }
 
-      bool in(seconds_t to, task const & f)
+      bool in(milliseconds_t to, task const & f, milliseconds_t slack = 0u)
+      {
+        return at(_sched.now() + to, f, slack);
+      }
+
+      /**
+       * Move the deadline of a pending task to \c to milliseconds from now,
+       * keeping its slack. A later deadline is only recorded; an earlier one
+       * re-queues the task immediately unless the slack covers the difference.
+       * Returns \c false, and does nothing, if no task is pending.
+       */
+      bool extend(milliseconds_t to)
+      {
+        if (!pending()) return false;
+        _deadline = _sched.now() + to;
+        if (_deadline + _slack < _id.first)
+        {
+          _sched.unsafe_cancel(_id);
+          _id = _sched.at(_deadline, trampoline(), _slack);
+        }
+        return true;
+      }
+
+      schedule &        get_schedule()          { return _sched; }
+      schedule const &  get_schedule() const    { return _sched; }
+
+    private:
+      void fire()
+      {
+        BOOST_ASSERT(pending());
+        if (_deadline > _id.first)
+        {
+          _id = _sched.at(_deadline, trampoline(), _slack);
+          return;
+        }
+        _id.first = static_cast<monotonic_time_t>(0);
+        task f;
+        using std::swap;
+        swap(f, _task);
+        f();                    // may destroy *this
+      }
+
+      void rebind()
+      {
+        if (pending()) _id.second->second = trampoline();
+      }
+
+      task trampoline()
+      {
+        return task(boost::bind(&timeout::fire, this));
+      }
+
+      schedule &        _sched;
+      task_id           _id;
+      monotonic_time_t  _deadline;
+      milliseconds_t    _slack;
+      task              _task;
+    };
+
+    /**
+     * A handle for a task that runs every \c period milliseconds.
+     *
+     * The task is stored in the handle once; each period only moves the
+     * handle's trampoline to the next deadline, which allocates nothing with
+     * ioxx::timing_wheel. Deadlines are multiples of the period after the
+     * first one, so late runs don't accumulate drift. If the schedule falls
+     * behind by more than a period, the missed runs are skipped rather than
+     * run back-to-back. The task may cancel() or re-arm its own handle, but
+     * it must not destroy it.
+     */
+    class periodic : private boost::noncopyable
+    {
+    public:
+      periodic(schedule & sched)
+      : _sched(sched), _id(static_cast<monotonic_time_t>(0), queue_iterator()), _period(0u)
+      {
+      }
+
+      periodic(schedule & sched, milliseconds_t period, task const & f)
+      : _sched(sched), _id(static_cast<monotonic_time_t>(0), queue_iterator()), _period(0u)
+      {
+        every(period, f);
+      }
+
+      ~periodic()
+      {
+        cancel();
+      }
+
+      bool pending() const
+      {
+        return _id.first != 0;
+      }
+
+      bool cancel()
       {
-        return at(_sched.now() + to, f);
+        if (!pending()) return false;
+        _sched.unsafe_cancel(_id);
+        _task = task();
+        return true;
       }
 
+      /**
+       * Run \c f every \c period milliseconds, starting one period from
+       * now. Returns \c true if this replaced a pending task.
+       */
+      bool every(milliseconds_t period, task const & f)
+      {
+        BOOST_ASSERT(period > 0u);
+        bool const cancelled( pending() );
+        if (cancelled) _sched.unsafe_cancel(_id);
+        _task = f;
+        _period = period;
+        _id = _sched.at(_sched.now() + period, task(boost::bind(&periodic::fire, this)));
+        return cancelled;
+      }
+
+      milliseconds_t period() const { return _period; }
+
       schedule &        get_schedule()          { return _sched; }
       schedule const &  get_schedule() const    { return _sched; }
 
     private:
-      schedule & _sched;
-      task_id    _id;
+      void fire()
+      {
+        BOOST_ASSERT(pending());
+        monotonic_time_t next( _id.first + _period );
+        if (next < _sched.now())
+          next += ((_sched.now() - next - 1u) / _period + 1u) * _period;
+        _id = _sched.at(next, task(boost::bind(&periodic::fire, this)));
+        task f;                 // cancel() and every() must not destroy the running task
+        using std::swap;
+        swap(f, _task);
+        try
+        {
+          f();
+        }
+        catch(...)
+        {
+          restore(f);
+          throw;
+        }
+        restore(f);
+      }
+
+      void restore(task & f)
+      {
+        using std::swap;
+        if (pending() && _task.empty()) swap(f, _task);
+      }
+
+      schedule &        _sched;
+      task_id           _id;
+      milliseconds_t    _period;
+      task              _task;
     };
 
-    explicit schedule(time_t const & now) : _now(now)
+    explicit schedule(monotonic_time_t const & now) : _now(now), _wakeups(0u), _coalesced(0u)
     {
     }
 
-    time_t const & now() const
+    monotonic_time_t const & now() const
     {
       return _now;
     }
 
-    task_id at(time_t ts, task const & f)
+    task_id at(monotonic_time_t ts, task const & f, milliseconds_t slack = 0u)
+    {
+      monotonic_time_t const key( coalesce(ts, slack) );
+      return task_id(key, _queue.insert(queue_entry(key, f)));
+    }
+
+    task_id in(milliseconds_t to, task const & f, milliseconds_t slack = 0u)
     {
-      return task_id(ts, _queue.insert(queue_entry(ts, f)));
+      return at(_now + to, f, slack);
     }
 
-    task_id in(seconds_t to, task const & f)
+    /**
+     * Pick the deadline in <code>[ts, ts + slack]</code> that is the
+     * roundest number in binary. Tasks whose windows overlap thus tend to end
+     * up on the same deadline; this is how Linux applies timer slack, too.
+     */
+    static monotonic_time_t coalesce(monotonic_time_t ts, milliseconds_t slack)
     {
-      return at(_now + to, f);
+      if (slack == 0u || ts == 0u) return ts;
+      monotonic_time_t const limit( ts + slack );
+      monotonic_time_t mask( (ts - 1u) ^ limit );
+      unsigned int bit( 0u );
+      while (mask >>= 1) ++bit;
+      return limit & ~((static_cast<monotonic_time_t>(1) << bit) - 1u);
     }
 
     void unsafe_cancel(task_id & tid)
@@ -127,27 +357,25 @@ namespace ioxx
       BOOST_ASSERT(tid.first != 0);
       BOOST_ASSERT(!_queue.empty());
       _queue.erase(tid.second);
-      tid.first = static_cast<time_t>(0);
+      tid.first = static_cast<monotonic_time_t>(0);
     }
 
     bool cancel(task_id & tid)
     {
       if (tid.first == 0 || _queue.empty()) return false;
-      queue_iterator i( _queue.begin() );
-      if (tid.first > i->first)
+      if (tid.first > _queue.begin()->first)
       {
         unsafe_cancel(tid);
         return true;
       }
-      while (i->first == tid.first)
+      std::pair<queue_iterator,queue_iterator> const r( _queue.equal_range(tid.first) );
+      for (queue_iterator i( r.first ); i != r.second; ++i)
       {
         if (i == tid.second)
         {
           unsafe_cancel(tid);
           return true;
         }
-        else
-          ++i;
       }
       return false;
     }
@@ -157,26 +385,66 @@ namespace ioxx
       return _queue.empty();
     }
 
-    seconds_t run()
+    /**
+     * The number of calls to run() that found tasks to execute.
+     */
+    size_t wakeups() const
+    {
+      return _wakeups;
+    }
+
+    /**
+     * The number of tasks that ran in a wakeup they shared with another task,
+     * i.e. the number of wakeups saved compared to waking up once per task.
+     */
+    size_t coalesced() const
+    {
+      return _coalesced;
+    }
+
+    stats const & schedule_stats() const
+    {
+      return _stats;
+    }
+
+    /**
+     * Run at most \c max_tasks tasks that are due. Returns the number of
+     * milliseconds until the next task is due, or 0 if the schedule is empty
+     * or if due tasks are left over for the next call.
+     */
+    milliseconds_t run(size_t max_tasks = std::numeric_limits<size_t>::max())
     {
+      advance_task_queue(_queue, _now);
+      bool woke( false );
       while (!empty())
       {
         queue_iterator i( _queue.begin() );
         if (i->first <= _now)
         {
+          if (max_tasks-- == 0u) return 0u;
           task f(i->second);
+          monotonic_time_t const due( i->first );
           _queue.erase(i);
+          if (woke) ++_coalesced;
+          else      { woke = true; ++_wakeups; }
+          boost::uint64_t const started( stats::now() );
           f();
+          _stats.task_ran(_now - due, started);
         }
         else
-          return static_cast<seconds_t>(i->first - _now);
+          return static_cast<milliseconds_t>(std::min<monotonic_time_t>( i->first - _now
+                                                                       , std::numeric_limits<milliseconds_t>::max()
+                                                                       ));
       }
       return 0;
     }
 
   private:
-    time_t const &      _now;
-    task_queue          _queue;
+    monotonic_time_t const &    _now;
+    task_queue                  _queue;
+    size_t                      _wakeups;
+    size_t                      _coalesced;
+    stats                       _stats;
   };
 
 } // namespace ioxx
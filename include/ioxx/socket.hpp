@@ -180,6 +180,32 @@ namespace ioxx
       throw_errno_if_minus1("bind with SO_REUSEADDR", boost::bind(boost::type<int>(), &::setsockopt, _sock, SOL_SOCKET, SO_REUSEADDR, &true_flag, sizeof(int)));
     }
 
+#if defined IOXX_HAVE_REUSEPORT && IOXX_HAVE_REUSEPORT
+    /**
+     * Allow other sockets to bind to the same address and port. The kernel
+     * distributes incoming connections over all of them.
+     */
+    void reuse_port(bool enable = true)
+    {
+      int true_flag = enable ? 1 : 0;
+      throw_errno_if_minus1("bind with SO_REUSEPORT", boost::bind(boost::type<int>(), &::setsockopt, _sock, SOL_SOCKET, SO_REUSEPORT, &true_flag, sizeof(int)));
+    }
+#endif
+
+#if defined IOXX_HAVE_BUSY_POLL && IOXX_HAVE_BUSY_POLL
+    /**
+     * Let the kernel poll the network device for up to \c microseconds when
+     * a receive on this socket, or an \c epoll_wait(2) that watches it,
+     * would block. Values above the \c net.core.busy_read sysctl need
+     * \c CAP_NET_ADMIN.
+     */
+    void set_busy_poll(unsigned int microseconds)
+    {
+      int usec = static_cast<int>(microseconds);
+      throw_errno_if_minus1("set SO_BUSY_POLL", boost::bind(boost::type<int>(), &::setsockopt, _sock, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(int)));
+    }
+#endif
+
     void bind(address const & addr)
     {
       throw_errno_if_minus1("bind(2)", boost::bind(boost::type<int>(), &::bind, _sock, &addr.as_sockaddr(), addr.as_socklen_t()));
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_STATS_HPP_INCLUDED_2010_02_23
+#define IOXX_STATS_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/error.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/assert.hpp>
+#include <cstddef>
+#include <time.h>
+
+namespace ioxx
+{
+  /**
+   * The statistics policy of ioxx::dispatch, ioxx::schedule, and
+   * detail::adns that records nothing. Its clock always reads 0 and its
+   * hooks are empty, so the compiler drops the calls along with the clock
+   * readings that would feed them.
+   */
+  struct no_stats
+  {
+    static bool const enabled = false;
+
+    static boost::uint64_t now()                                { return 0u; }
+
+    void handled(boost::uint64_t)                               { }
+    void waited(boost::uint64_t, size_t)                        { }
+    void task_ran(boost::uint64_t, boost::uint64_t)             { }
+    void resolved(boost::uint64_t)                              { }
+  };
+
+  /**
+   * Counts of samples in power-of-two buckets: bucket 0 holds the value 0,
+   * bucket \c i the values in <code>[2^(i-1), 2^i)</code>, and the last
+   * bucket everything larger.
+   *
+   * One thread adds samples; any thread may read the counts without a lock.
+   * Every count is a single machine word, so a reading is never torn, but
+   * counts read one after another needn't add up to samples(). sum() is 64
+   * bits wide, so that it doesn't overflow; on 32-bit targets, a reading
+   * taken while a sample is being added may be torn.
+   */
+  class histogram
+  {
+  public:
+    static size_t const buckets = 32u;
+
+    histogram() : _samples(0u), _sum(0u)
+    {
+      for (size_t i(0u); i != buckets; ++i) _count[i] = 0u;
+    }
+
+    void add(boost::uint64_t v)
+    {
+      ++_count[bucket(v)];
+      _sum = _sum + v;
+      ++_samples;
+    }
+
+    size_t count(size_t i) const
+    {
+      BOOST_ASSERT(i < buckets);
+      return _count[i];
+    }
+
+    size_t samples() const              { return _samples; }
+    boost::uint64_t sum() const         { return _sum; }
+
+    /// The smallest value that no longer falls into bucket \c i.
+    static boost::uint64_t upper_bound(size_t i)
+    {
+      BOOST_ASSERT(i < buckets);
+      return static_cast<boost::uint64_t>(1u) << i;
+    }
+
+    /**
+     * An upper bound for the value below which the fraction \c p of all
+     * samples falls, e.g. <code>percentile(0.99)</code>.
+     */
+    boost::uint64_t percentile(double p) const
+    {
+      BOOST_ASSERT(p >= 0.0 && p <= 1.0);
+      size_t const n( samples() );
+      size_t seen( 0u );
+      for (size_t i(0u); i != buckets; ++i)
+      {
+        seen += count(i);
+        if (seen > 0u && seen >= p * n) return upper_bound(i);
+      }
+      return upper_bound(buckets - 1u);
+    }
+
+    static size_t bucket(boost::uint64_t v)
+    {
+      if (!v) return 0u;
+#if defined __GNUC__
+      size_t const i( 64u - static_cast<size_t>(__builtin_clzll(v)) );
+#else
+      size_t i( 0u );
+      for (; v; v >>= 1) ++i;
+#endif
+      return i < buckets ? i : buckets - 1u;
+    }
+
+  private:
+    size_t volatile             _count[buckets];
+    size_t volatile             _samples;
+    boost::uint64_t volatile    _sum;
+  };
+
+  /**
+   * The statistics policy that records where an event loop spends its time.
+   * Pass it as the \c Stats parameter of ioxx::dispatch, ioxx::schedule,
+   * detail::adns, or ioxx::core. Durations are measured in microseconds of
+   * the monotonic clock; timer lateness is measured in milliseconds, the
+   * resolution of the schedule.
+   *
+   * The loop's thread records; other threads may read the figures at any
+   * time without locking, see ioxx::histogram.
+   */
+  class loop_stats
+  {
+  public:
+    static bool const enabled = true;
+
+    loop_stats() : _ctl_calls(0u), _events_since_wait(0u)
+    {
+    }
+
+    static boost::uint64_t now()
+    {
+      timespec ts;
+      throw_errno_if_minus1("clock_gettime(2)", boost::bind(boost::type<int>(), clock_gettime, CLOCK_MONOTONIC, &ts));
+      return static_cast<boost::uint64_t>(ts.tv_sec) * 1000000u + static_cast<boost::uint64_t>(ts.tv_nsec) / 1000u;
+    }
+
+    /// Socket events that a dispatch::run() delivered between two waits.
+    histogram const & events_per_wait() const   { return _events_per_wait; }
+
+    /// Time spent in event handlers.
+    histogram const & handler_time() const      { return _handler_time; }
+
+    /// Time spent blocked in dispatch::wait().
+    histogram const & wait_time() const         { return _wait_time; }
+
+    /// How much later than scheduled tasks ran, in milliseconds.
+    histogram const & task_lateness() const     { return _task_lateness; }
+
+    /// Time spent in scheduled tasks.
+    histogram const & task_time() const         { return _task_time; }
+
+    /// Time from submitting a DNS query until its handler ran.
+    histogram const & query_time() const        { return _query_time; }
+
+    /// System calls that changed the interest set of the demultiplexer.
+    size_t ctl_calls() const                    { return _ctl_calls; }
+
+    // The hooks are called by the loop; their arguments are readings of
+    // now() taken at the start of what they measure.
+
+    void handled(boost::uint64_t started)
+    {
+      _handler_time.add(now() - started);
+      ++_events_since_wait;
+    }
+
+    void waited(boost::uint64_t started, size_t ctl_calls)
+    {
+      _wait_time.add(now() - started);
+      _events_per_wait.add(_events_since_wait);
+      _events_since_wait = 0u;
+      _ctl_calls = ctl_calls;
+    }
+
+    void task_ran(boost::uint64_t lateness, boost::uint64_t started)
+    {
+      _task_lateness.add(lateness);
+      _task_time.add(now() - started);
+    }
+
+    void resolved(boost::uint64_t submitted)
+    {
+      _query_time.add(now() - submitted);
+    }
+
+  private:
+    histogram           _events_per_wait;
+    histogram           _handler_time;
+    histogram           _wait_time;
+    histogram           _task_lateness;
+    histogram           _task_time;
+    histogram           _query_time;
+    size_t volatile     _ctl_calls;
+    size_t              _events_since_wait;
+  };
+
+} // namespace ioxx
+
+#endif // IOXX_STATS_HPP_INCLUDED_2010_02_23
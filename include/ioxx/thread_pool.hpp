@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_THREAD_POOL_HPP_INCLUDED_2010_02_23
+#define IOXX_THREAD_POOL_HPP_INCLUDED_2010_02_23
+
+#include <ioxx/detail/pthread.hpp>
+#include <ioxx/detail/logging.hpp>
+#include <ioxx/detail/show.hpp>
+#include <boost/function/function0.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <deque>
+#include <vector>
+
+namespace ioxx
+{
+  /**
+   * Worker threads for jobs that would stall an event loop.
+   *
+   * Event handlers run inline in the thread of their ioxx::core, so a
+   * handler that compresses or parses for a few milliseconds delays every
+   * other socket of that core. offload() moves such a job into the pool and
+   * posts its continuation back to the core through core::post() when the
+   * job is done:
+   *
+   * \code
+   *   pool.offload(io, bind(&request::parse, req), bind(&request::respond, req));
+   * \endcode
+   *
+   * Every worker owns a deque of jobs. submit() distributes jobs round-robin
+   * over the deques; a worker takes the oldest job of its own deque, and
+   * when that is empty, it steals the newest job of another worker. Thus, a
+   * worker that is stuck in a long job doesn't hold up the jobs queued
+   * behind it. Idle workers sleep on a condition variable; submit() takes
+   * the lock that guards it only if a worker may be asleep.
+   *
+   * submit() and offload() may be called from any thread, including the
+   * workers. Jobs must not throw. The destructor runs all queued jobs and
+   * then joins the workers.
+   */
+  template <class Job = boost::function0<void> >
+  class thread_pool : private boost::noncopyable
+  {
+  public:
+    typedef Job job;
+
+    struct statistics
+    {
+      statistics() : executed(0u), stolen(0u) { }
+
+      size_t executed;          ///< jobs this worker has run
+      size_t stolen;            ///< of which it took from other workers
+    };
+
+    /**
+     * Start \c n workers; the default is one per online CPU.
+     */
+    explicit thread_pool(size_t n = detail::online_cpus()) : _queued(0u), _sleepers(0u), _next(0u), _stopping(false)
+    {
+      BOOST_ASSERT(n > 0u);
+      LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.thread_pool(" + detail::show(this) + ')');
+      for (size_t i(0u); i != n; ++i)
+        _workers.push_back(boost::shared_ptr<worker>(new worker(*this, i)));
+      size_t started( 0u );
+      try
+      {
+        for (; started != n; ++started)
+          detail::throw_if_pthread_error(pthread_create(&_workers[started]->thread, 0, &thread_pool::thread_main, _workers[started].get()), "pthread_create(3)");
+      }
+      catch(...)
+      {
+        join(started);
+        throw;
+      }
+      LOGXX_TRACE("started " << n << " workers");
+    }
+
+    ~thread_pool()
+    {
+      join(_workers.size());
+      LOGXX_TRACE("stopped");
+    }
+
+    size_t size() const { return _workers.size(); }
+
+    /**
+     * Queue \c j for execution in one of the workers.
+     */
+    void submit(job const & j)
+    {
+      worker & w( *_workers[__sync_fetch_and_add(&_next, 1u) % _workers.size()] );
+      __sync_fetch_and_add(&_queued, 1u);       // before a thief can take the job
+      try
+      {
+        detail::mutex::scoped_lock lock(w.mutex);
+        w.jobs.push_back(j);
+      }
+      catch(...)
+      {
+        __sync_fetch_and_sub(&_queued, 1u);
+        throw;
+      }
+      // A worker counts itself as a sleeper before it looks at _queued, and
+      // both counters change with a full barrier, so either it sees the job
+      // or we see the worker.
+      if (!const_cast<size_t volatile &>(_sleepers)) return;
+      detail::mutex::scoped_lock lock(_mutex);
+      _wake_up.notify_one();
+    }
+
+    /**
+     * Run \c work in a worker, then post \c done to \c io, so that it runs
+     * in the thread of that core.
+     */
+    template <class Core>
+    void offload(Core & io, job const & work, typename Core::schedule::task const & done)
+    {
+      submit(boost::bind(&thread_pool::run_and_post<Core>, boost::ref(io), work, done));
+    }
+
+    /**
+     * Statistics about worker \c i. Other threads update them while the
+     * pool is running, so the figures are approximate until it's destroyed.
+     */
+    statistics const & stats(size_t i) const
+    {
+      BOOST_ASSERT(i < _workers.size());
+      return _workers[i]->stats;
+    }
+
+  protected:
+    LOGXX_DEFINE_TARGET(LOGXX_SCOPE_NAME);
+
+  private:
+    struct worker : private boost::noncopyable
+    {
+      worker(thread_pool & p, size_t i) : pool(p), index(i), thread() { }
+
+      thread_pool &     pool;
+      size_t const      index;
+      pthread_t         thread;
+      detail::mutex     mutex;
+      std::deque<job>   jobs;
+      statistics        stats;
+    };
+
+    std::vector< boost::shared_ptr<worker> >    _workers;
+    size_t                                      _queued;        // jobs in all deques
+    size_t                                      _sleepers;      // workers that may be waiting for _wake_up
+    size_t                                      _next;
+    bool                                        _stopping;      // guarded by _mutex
+    detail::mutex                               _mutex;
+    detail::condition                           _wake_up;
+
+    template <class Core>
+    static void run_and_post(Core & io, job const & work, typename Core::schedule::task const & done)
+    {
+      work();
+      io.post(done);
+    }
+
+    static void * thread_main(void * p)
+    {
+      worker & w( *static_cast<worker *>(p) );
+      w.pool.run(w);
+      return 0;
+    }
+
+    void run(worker & w)
+    {
+      job j;
+      for (;;)
+      {
+        if (take(w, j))
+        {
+          __sync_fetch_and_sub(&_queued, 1u);
+          j();
+          j = job();
+          ++w.stats.executed;
+          continue;
+        }
+        detail::mutex::scoped_lock lock(_mutex);
+        __sync_fetch_and_add(&_sleepers, 1u);   // see submit()
+        while (!const_cast<size_t volatile &>(_queued) && !_stopping)
+          _wake_up.wait(_mutex);
+        __sync_fetch_and_sub(&_sleepers, 1u);
+        if (_stopping && !const_cast<size_t volatile &>(_queued)) return;
+      }
+    }
+
+    bool take(worker & w, job & j)
+    {
+      {
+        detail::mutex::scoped_lock lock(w.mutex);
+        if (!w.jobs.empty())
+        {
+          j = w.jobs.front();
+          w.jobs.pop_front();
+          return true;
+        }
+      }
+      for (size_t i(1u); i != _workers.size(); ++i)
+      {
+        worker & victim( *_workers[(w.index + i) % _workers.size()] );
+        detail::mutex::scoped_lock lock(victim.mutex);
+        if (!victim.jobs.empty())
+        {
+          j = victim.jobs.back();
+          victim.jobs.pop_back();
+          ++w.stats.stolen;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void join(size_t n)
+    {
+      {
+        detail::mutex::scoped_lock lock(_mutex);
+        _stopping = true;
+        _wake_up.notify_all();
+      }
+      for (size_t i(0u); i != n; ++i)
+      {
+        int const rc( pthread_join(_workers[i]->thread, 0) );
+        BOOST_ASSERT(rc == 0);
+      }
+    }
+  };
+
+} // namespace ioxx
+
+#endif // IOXX_THREAD_POOL_HPP_INCLUDED_2010_02_23
@@ -21,7 +21,9 @@
 #include <ioxx/error.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/compatibility/cpp_c_headers/ctime>
+#include <boost/cstdint.hpp>
 #include <sys/time.h>
+#include <time.h>
 
 namespace ioxx
 {
@@ -39,6 +41,24 @@ namespace ioxx
    */
   typedef unsigned int seconds_t;
 
+  /**
+   * An (unsigned) quantity of milliseconds.
+   *
+   * All timeouts in ioxx::schedule, ioxx::dispatch, and ioxx::core are
+   * specified in this unit. The type covers a little more than 49 days.
+   */
+  typedef unsigned int milliseconds_t;
+
+  /**
+   * A point in time, represented in milliseconds since some unspecified
+   * starting point.
+   *
+   * This clock is monotonic: unlike the time of day, it is not affected by
+   * changes of the system time, i.e. by the administrator or by NTP. Timeouts
+   * are scheduled in terms of this clock.
+   */
+  typedef boost::uint64_t monotonic_time_t;
+
   /**
    * The current time of day in microseconds since 1970-01-01 00:00:00 UTC.
    *
@@ -82,15 +102,24 @@ namespace ioxx
     timeval const & current_timeval() const  { return _now; }
 
     /**
-     * Update the time of day.
+     * Return the current reading of the monotonic clock.
+     */
+    monotonic_time_t const & current_monotonic_time() const { return _mono; }
+
+    /**
+     * Update the time of day and the monotonic clock.
      */
     void update()
     {
       throw_errno_if_minus1("gettimeofday(2)", boost::bind(boost::type<int>(), gettimeofday, &_now, static_cast<struct timezone *>(0)));
+      timespec ts;
+      throw_errno_if_minus1("clock_gettime(2)", boost::bind(boost::type<int>(), clock_gettime, CLOCK_MONOTONIC, &ts));
+      _mono = static_cast<monotonic_time_t>(ts.tv_sec) * 1000u + static_cast<monotonic_time_t>(ts.tv_nsec) / 1000000u;
     }
 
   private:
-    timeval _now;
+    timeval             _now;
+    monotonic_time_t    _mono;
   };
 
 } // namespace ioxx
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOXX_TIMING_WHEEL_HPP_INCLUDED_2010_02_23
+#define IOXX_TIMING_WHEEL_HPP_INCLUDED_2010_02_23
+
+#include <boost/noncopyable.hpp>
+#include <boost/assert.hpp>
+#include <boost/type_traits/make_unsigned.hpp>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace ioxx
+{
+  /**
+   * Hierarchical timing wheel.
+   *
+   * This container can be used as the \c TaskQueue of a ioxx::schedule in
+   * place of the default \c std::multimap. Insertion and removal of an entry
+   * cost O(1), and so does finding the next entry to expire, amortized over
+   * the life-time of the entry. An entry is moved down at most four times
+   * before it expires, once per wheel level. Allocation happens through the
+   * given \c Allocator, just like it would for the \c std::multimap. The
+   * wheel keeps the node of the most recent erase() around for the next
+   * insert(), so a task that re-arms itself doesn't allocate at all.
+   *
+   * The wheel has four levels of 256 buckets each. Level 0 resolves single
+   * ticks, level 1 resolves 256 ticks, and so on. Entries scheduled more than
+   * 2^32 ticks into the future go into an overflow bucket. When the wheel's
+   * clock advances, buckets that come within reach are spread out over the
+   * lower levels ("cascading"). The wheel learns the current time through
+   * advance_task_queue(), which ioxx::schedule calls before it looks for
+   * expired tasks.
+   *
+   * The interface is the subset of \c std::multimap that ioxx::schedule
+   * relies on: insert(), erase(), begin(), and equal_range(). Iterators
+   * advance through the entries of one bucket only; they are not meant for
+   * walking the whole container.
+   *
+   * The design follows G. Varghese and T. Lauck, "Hashed and Hierarchical
+   * Timing Wheels", IEEE/ACM Transactions on Networking, 1997.
+   */
+  template < class Key
+           , class Task
+           , class Allocator = std::allocator<void>
+           >
+  class timing_wheel : private boost::noncopyable
+  {
+  public:
+    typedef Key                                 key_type;
+    typedef Task                                mapped_type;
+    typedef std::pair<Key const, Task>          value_type;
+    typedef std::size_t                         size_type;
+
+  private:
+    struct node
+    {
+      explicit node(value_type const & v) : value(v), prev(0), next(0) { }
+
+      value_type        value;
+      node *            prev;
+      node *            next;
+    };
+
+    typedef typename Allocator::template rebind<node>::other    node_allocator;
+    typedef typename boost::make_unsigned<Key>::type            tick_t;
+
+  public:
+    class iterator
+    {
+    public:
+      iterator() : _node(0) { }
+
+      value_type & operator*  () const  { BOOST_ASSERT(_node); return _node->value; }
+      value_type * operator-> () const  { BOOST_ASSERT(_node); return &_node->value; }
+
+      iterator & operator++ ()          { BOOST_ASSERT(_node); _node = _node->next; return *this; }
+      iterator   operator++ (int)       { iterator i(*this); ++(*this); return i; }
+
+      friend bool operator== (iterator const & lhs, iterator const & rhs) { return lhs._node == rhs._node; }
+      friend bool operator!= (iterator const & lhs, iterator const & rhs) { return lhs._node != rhs._node; }
+
+    private:
+      friend class timing_wheel;
+      explicit iterator(node * n) : _node(n) { }
+      node * _node;
+    };
+
+    timing_wheel() : _time(0u), _now(0u), _size(0u), _spare(0)
+    {
+      std::fill(&_bitmap[0][0], &_bitmap[0][0] + levels * words, 0ul);
+      std::fill(&_bucket[0][0], &_bucket[0][0] + levels * slots, bucket());
+    }
+
+    ~timing_wheel()
+    {
+      clear();
+      if (_spare) _alloc.deallocate(_spare, 1u);
+    }
+
+    bool      empty() const     { return _size == 0u; }
+    size_type size()  const     { return _size; }
+
+    iterator  end()   const     { return iterator(); }
+
+    /**
+     * Return the entry that expires first. Entries that expire at the same
+     * time are returned in the order they were inserted.
+     */
+    iterator begin()
+    {
+      settle();
+      if (empty()) return end();
+      unsigned int level;
+      if (lowest_level(level))
+      {
+        bucket & b( _bucket[level][lowest_slot(level)] );
+        return iterator(level == 0u ? b.head : bucket_min(b));
+      }
+      BOOST_ASSERT(_overflow.head);
+      return iterator(bucket_min(_overflow));
+    }
+
+    /**
+     * Return a range that contains all entries with key \c k. The range may
+     * contain other entries, too.
+     */
+    std::pair<iterator,iterator> equal_range(key_type const & k)
+    {
+      return std::make_pair(iterator(locate(static_cast<tick_t>(k)).head), end());
+    }
+
+    iterator insert(value_type const & v)
+    {
+      node * const n( _spare ? _spare : _alloc.allocate(1u) );
+      _spare = 0;
+      try { new (n) node(v); }
+      catch(...) { release(n); throw; }
+      place(n);
+      ++_size;
+      return iterator(n);
+    }
+
+    void erase(iterator i)
+    {
+      node * const n( i._node );
+      BOOST_ASSERT(n);
+      BOOST_ASSERT(_size);
+      unlink(n);
+      --_size;
+      n->~node();
+      release(n);
+    }
+
+    void clear()
+    {
+      for (unsigned int l(0u); l != levels; ++l)
+        for (unsigned int s(0u); s != slots; ++s)
+          destroy(_bucket[l][s]);
+      destroy(_overflow);
+      std::fill(&_bitmap[0][0], &_bitmap[0][0] + levels * words, 0ul);
+      _size = 0u;
+    }
+
+    /**
+     * Advance the wheel's clock to \c now. Entries with a key less than or
+     * equal to \c now have expired; begin() returns them first.
+     */
+    void advance(key_type const & now)
+    {
+      _now = std::max(_now, static_cast<tick_t>(now));
+      settle();
+    }
+
+  private:
+    static unsigned int const bits   = 8u;
+    static unsigned int const slots  = 1u << bits;
+    static unsigned int const levels = 4u;
+    static unsigned int const words  = slots / std::numeric_limits<unsigned long>::digits;
+
+    struct bucket
+    {
+      bucket() : head(0), tail(0), min(0) { }
+
+      node *    head;
+      node *    tail;
+      node *    min;            // cached minimum; 0 if unknown
+    };
+
+    tick_t              _time;  // no entry expires before this point, except those in its own bucket
+    tick_t              _now;   // most recent time passed to advance()
+    size_type           _size;
+    bucket              _bucket[levels][slots];
+    unsigned long       _bitmap[levels][words];
+    bucket              _overflow;
+    node *              _spare; // storage of an erased node, kept for re-use
+    node_allocator      _alloc;
+
+    static tick_t key(node const * n) { return static_cast<tick_t>(n->value.first); }
+
+    /**
+     * The part of \c t that lies beyond the reach of the wheel's levels.
+     */
+    static tick_t beyond(tick_t t) { return t >> (levels * bits - 1u) >> 1; }
+
+    static unsigned int digit(tick_t t, unsigned int level)
+    {
+      return static_cast<unsigned int>(t >> (level * bits)) & (slots - 1u);
+    }
+
+    /**
+     * The bucket where an entry with the given key is stored. Keys that
+     * aren't in the future relative to _time go into the bucket of _time.
+     */
+    bucket & locate(tick_t t, unsigned int * level = 0, unsigned int * slot = 0)
+    {
+      unsigned int l( 0u );
+      if (t > _time)
+      {
+        tick_t const d( t ^ _time );
+        for (l = 1u; l != levels; ++l)
+          if (d >> (l * bits) == 0u) break;
+        --l;
+        if (beyond(d)) return _overflow;
+      }
+      else
+        t = _time;
+      if (level) *level = l;
+      if (slot)  *slot  = digit(t, l);
+      return _bucket[l][digit(t, l)];
+    }
+
+    void place(node * n)
+    {
+      unsigned int level( 0u ), slot( 0u );
+      tick_t const t( key(n) );
+      bucket & b( locate(t, &level, &slot) );
+      if (&b == &_overflow)
+        level = 1u;             // keep track of the minimum
+      else
+        _bitmap[level][slot / std::numeric_limits<unsigned long>::digits] |= 1ul << (slot % std::numeric_limits<unsigned long>::digits);
+      n->next = 0;
+      n->prev = b.tail;
+      if (t < _time)
+      {
+        // An overdue entry: keep the bucket of _time sorted.
+        node * i( b.head );
+        while (i && key(i) <= t) i = i->next;
+        if (i)
+        {
+          n->next = i;
+          n->prev = i->prev;
+          i->prev = n;
+          if (n->prev) n->prev->next = n;
+          else         b.head = n;
+          return;
+        }
+      }
+      if (b.tail) b.tail->next = n;
+      else        b.head = n;
+      b.tail = n;
+      if (level != 0u && (b.head == n || (b.min && t < key(b.min))))
+        b.min = n;
+    }
+
+    void unlink(node * n)
+    {
+      unsigned int level( 0u ), slot( 0u );
+      bucket & b( locate(key(n), &level, &slot) );
+      if (n->prev) n->prev->next = n->next;
+      else         { BOOST_ASSERT(b.head == n); b.head = n->next; }
+      if (n->next) n->next->prev = n->prev;
+      else         { BOOST_ASSERT(b.tail == n); b.tail = n->prev; }
+      if (b.min == n) b.min = 0;
+      if (!b.head && &b != &_overflow)
+        _bitmap[level][slot / std::numeric_limits<unsigned long>::digits] &= ~(1ul << (slot % std::numeric_limits<unsigned long>::digits));
+    }
+
+    node * bucket_min(bucket & b)
+    {
+      BOOST_ASSERT(b.head);
+      if (!b.min)
+      {
+        b.min = b.head;
+        for (node * i( b.head->next ); i; i = i->next)
+          if (key(i) < key(b.min)) b.min = i;
+      }
+      return b.min;
+    }
+
+    bool lowest_level(unsigned int & level) const
+    {
+      for (level = 0u; level != levels; ++level)
+        for (unsigned int w(0u); w != words; ++w)
+          if (_bitmap[level][w]) return true;
+      return false;
+    }
+
+    unsigned int lowest_slot(unsigned int level) const
+    {
+      for (unsigned int w(0u); w != words; ++w)
+        if (_bitmap[level][w])
+          return w * std::numeric_limits<unsigned long>::digits + lowest_bit(_bitmap[level][w]);
+      BOOST_ASSERT(false);
+      return slots;
+    }
+
+    static unsigned int lowest_bit(unsigned long w)
+    {
+      BOOST_ASSERT(w != 0u);
+#if defined __GNUC__
+      return static_cast<unsigned int>(__builtin_ctzl(w));
+#else
+      unsigned int n( 0u );
+      for (; !(w & 1ul); w >>= 1) ++n;
+      return n;
+#endif
+    }
+
+    /**
+     * Move _time towards _now as far as possible without passing any entry.
+     * Buckets that come within reach are spread out over the lower levels.
+     */
+    void settle()
+    {
+      while (_time < _now)
+      {
+        unsigned int level;
+        if (!lowest_level(level))
+        {
+          if (!_overflow.head) return set_time(_now);
+          tick_t const t( key(bucket_min(_overflow)) );
+          tick_t const start( beyond(t) << (levels * bits - 1u) << 1 );
+          if (start > _now) return set_time(_now);
+          set_time(start);
+          continue;
+        }
+        unsigned int const slot( lowest_slot(level) );
+        if (level == 0u)
+        {
+          if (slot == digit(_time, 0u)) return;         // expired entries are pending
+          tick_t const t( key(_bucket[0u][slot].head) );
+          return set_time(std::min(t, _now));
+        }
+        tick_t const mask( (tick_t(1u) << ((level + 1u) * bits - 1u) << 1) - 1u );
+        tick_t const start( (_time & ~mask) | (static_cast<tick_t>(slot) << (level * bits)) );
+        if (start > _now) return set_time(_now);
+        set_time(start);
+        bucket & b( _bucket[level][slot] );
+        node * i( b.head );
+        b = bucket();
+        _bitmap[level][slot / std::numeric_limits<unsigned long>::digits] &= ~(1ul << (slot % std::numeric_limits<unsigned long>::digits));
+        while (i)
+        {
+          node * const n( i );
+          i = i->next;
+          place(n);
+        }
+      }
+    }
+
+    void set_time(tick_t t)
+    {
+      BOOST_ASSERT(t >= _time);
+      bool const wrapped( beyond(t ^ _time) != 0u );
+      _time = t;
+      if (wrapped && _overflow.head)
+      {
+        node * i( _overflow.head );
+        _overflow = bucket();
+        while (i)
+        {
+          node * const n( i );
+          i = i->next;
+          place(n);
+        }
+      }
+    }
+
+    void release(node * n)
+    {
+      if (_spare) _alloc.deallocate(n, 1u);
+      else        _spare = n;
+    }
+
+    void destroy(bucket & b)
+    {
+      for (node * i( b.head ); i; /**/)
+      {
+        node * const n( i );
+        i = i->next;
+        n->~node();
+        _alloc.deallocate(n, 1u);
+      }
+      b = bucket();
+    }
+  };
+
+  /**
+   * \internal
+   *
+   * Overload of advance_task_queue() that drives the wheel's clock.
+   */
+  template <class Key, class Task, class Allocator, class Time>
+  inline void advance_task_queue(timing_wheel<Key,Task,Allocator> & queue, Time const & now)
+  {
+    queue.advance(static_cast<Key>(now));
+  }
+
+} // namespace ioxx
+
+#endif // IOXX_TIMING_WHEEL_HPP_INCLUDED_2010_02_23
@@ -63,13 +63,14 @@ private:
   {
     LOGXX_INFO("peer " << _peer << " resolves to \"" << (peer ? *peer : "NONE") << '"');
     _sock->modify(boost::bind(&daytime::run, this->shared_from_this(), _1), socket::writable);;
-    _timeout.in(10u, boost::bind(&daytime::shutdown, this->shared_from_this()));
+    _timeout.in(10000u, boost::bind(&daytime::shutdown, this->shared_from_this()), 1000u);
   }
 
   void run(event_set ev)
   {
     try
     {
+      if (ev & (socket::hangup | socket::error)) return shutdown(); // peer is gone
       BOOST_ASSERT(ev == socket::writable);
       BOOST_ASSERT(_data_begin != _data_end);
       char const * const p( _sock->send_to(_data_begin, _data_end, _peer) );
@@ -77,7 +78,7 @@ private:
       _data_begin = p;
       BOOST_ASSERT(_data_begin <= _data_end);
       if (_data_begin == _data_end) return shutdown();
-      _timeout.in(10u, boost::bind(&daytime::shutdown, this->shared_from_this()));
+      _timeout.extend(10000u);
     }
     catch(std::exception const & e)
     {
@@ -22,6 +22,8 @@
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 #include <boost/concept_check.hpp>
+#include <boost/shared_ptr.hpp>
+#include <vector>
 
 template <class T>
 struct demux_concept
@@ -45,12 +47,15 @@ struct demux_concept
     ev1 = socket::readable;
     ev1 = socket::writable;
     ev1 = socket::pridata;
+    ev1 = socket::hangup;
+    ev1 = socket::error;
+    ev1 = socket::read_hangup;
 
     demux dmx;
     native_socket_t sock;
     bool b( dmx.empty() );
     b = dmx.pop_event(sock, ev1);
-    dmx.wait(static_cast<ioxx::seconds_t>(0));
+    dmx.wait(static_cast<ioxx::milliseconds_t>(0));
 
     socket s2(dmx, sock), s3(dmx, sock, ev1);
     s2.request(ev1);
@@ -68,6 +73,9 @@ struct demux_archetype
     static event_set const readable  = 1 << 0;
     static event_set const writable  = 1 << 1;
     static event_set const pridata   = 1 << 2;
+    static event_set const hangup    = 1 << 3;
+    static event_set const error     = 1 << 4;
+    static event_set const read_hangup = 1 << 5;
 
     socket(demux_archetype &, ioxx::native_socket_t s) : ioxx::system_socket(s) { }
     socket(demux_archetype &, ioxx::native_socket_t s, event_set) : ioxx::system_socket(s) { }
@@ -81,12 +89,15 @@ struct demux_archetype
 
   bool empty() { return true; }
   bool pop_event(ioxx::native_socket_t & s, socket::event_set & ev)  { return false; }
-  void wait(ioxx::seconds_t to) { }
+  void wait(ioxx::milliseconds_t to) { }
 };
 
 demux_archetype::socket::event_set const demux_archetype::socket::readable;
 demux_archetype::socket::event_set const demux_archetype::socket::writable;
 demux_archetype::socket::event_set const demux_archetype::socket::pridata;
+demux_archetype::socket::event_set const demux_archetype::socket::hangup;
+demux_archetype::socket::event_set const demux_archetype::socket::error;
+demux_archetype::socket::event_set const demux_archetype::socket::read_hangup;
 
 template <class Demux>
 void use_standard_event_set_operators()
@@ -125,13 +136,89 @@ template <class Demux>
 void use_demuxer_for_sleeping()
 {
   ioxx::time_of_day now;
-  ioxx::time_t const pre_sleep( now.current_time_t() );
+  ioxx::monotonic_time_t const pre_sleep( now.current_monotonic_time() );
   Demux demux;
   BOOST_REQUIRE(demux.empty());
-  demux.wait(1u);
+  demux.wait(250u);
   now.update();
-  ioxx::time_t const post_sleep( now.current_time_t() );
-  BOOST_REQUIRE_PREDICATE(std::greater_equal<ioxx::time_t>(), (post_sleep)(pre_sleep));
+  ioxx::monotonic_time_t const post_sleep( now.current_monotonic_time() );
+  BOOST_REQUIRE_PREDICATE(std::greater_equal<ioxx::monotonic_time_t>(), (post_sleep)(pre_sleep + 250u));
+}
+
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+#  include <ioxx/detail/timerfd.hpp>
+
+template <class Demux>
+void use_timerfd_for_waking()
+{
+  typedef typename Demux::socket        socket;
+  typedef typename socket::event_set    event_set;
+
+  ioxx::time_of_day now;
+  ioxx::monotonic_time_t const deadline( now.current_monotonic_time() + 100u );
+  Demux demux;
+  ioxx::detail::timerfd timer;
+  socket s(demux, timer.as_native_socket_t(), socket::readable);
+  s.close_on_destruction(false);
+  timer.arm(deadline);
+  BOOST_REQUIRE_EQUAL(timer.armed(), deadline);
+  ioxx::native_socket_t fd;
+  event_set ev;
+  do
+  {
+    demux.wait(1000u);
+  }
+  while (!demux.pop_event(fd, ev));
+  now.update();
+  BOOST_REQUIRE_PREDICATE(std::greater_equal<ioxx::monotonic_time_t>(), (now.current_monotonic_time())(deadline));
+  BOOST_REQUIRE_EQUAL(fd, timer.as_native_socket_t());
+  BOOST_REQUIRE(ev & socket::readable);
+  timer.expire();
+  BOOST_REQUIRE_EQUAL(timer.armed(), 0u);
+  BOOST_REQUIRE(!demux.pop_event(fd, ev));
+}
+#endif
+
+// A pipe whose writer has gone away reports a hangup along with the end of
+// input; a stream socket whose peer has shut down writing reports a read
+// hangup if the reader asked for it. select(2) knows neither.
+
+template <class Demux>
+void report_hangups(bool reported, bool read_hangup_reported)
+{
+  typedef typename Demux::socket        socket;
+  typedef typename socket::event_set    event_set;
+
+  Demux demux;
+  ioxx::native_socket_t fd;
+  event_set ev;
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+    socket reader(demux, fds[0], socket::readable);
+    ::close(fds[1]);
+    demux.wait(1000u);
+    BOOST_REQUIRE(demux.pop_event(fd, ev));
+    BOOST_REQUIRE_EQUAL(fd, reader.as_native_socket_t());
+    BOOST_REQUIRE(ev & (reported ? socket::hangup : socket::readable));
+    BOOST_REQUIRE(!(ev & socket::error));
+  }
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("socketpair(2)", boost::bind(boost::type<int>(), &::socketpair, static_cast<int>(AF_UNIX), static_cast<int>(SOCK_STREAM), 0, fds));
+    socket reader(demux, fds[0], socket::read_hangup);
+    ioxx::system_socket writer(fds[1]);
+    ioxx::throw_errno_if_minus1("shutdown(2)", boost::bind(boost::type<int>(), &::shutdown, fds[1], static_cast<int>(SHUT_WR)));
+    demux.wait(read_hangup_reported ? 1000u : 0u);
+    if (read_hangup_reported)
+    {
+      BOOST_REQUIRE(demux.pop_event(fd, ev));
+      BOOST_REQUIRE_EQUAL(fd, reader.as_native_socket_t());
+      BOOST_REQUIRE_EQUAL(ev, socket::read_hangup);
+    }
+    else
+      BOOST_REQUIRE(!demux.pop_event(fd, ev));
+  }
 }
 
 template <class Demux>
@@ -140,6 +227,46 @@ void test_demux()
   boost::function_requires< demux_concept<Demux> >();
   use_standard_event_set_operators<Demux>();
   use_demuxer_for_sleeping<Demux>();
+#if defined IOXX_HAVE_TIMERFD && IOXX_HAVE_TIMERFD
+  use_timerfd_for_waking<Demux>();
+#endif
+}
+
+// Sockets that go away leave the batch and the queue of sockets whose
+// interest has changed, wherever they are in them.
+
+template <class Demux>
+void forget_queued_sockets()
+{
+  typedef Demux                         demux;
+  typedef typename demux::socket        socket;
+  typedef boost::shared_ptr<socket>     socket_ptr;
+
+  demux io;
+  std::vector<socket_ptr> readers;
+  std::vector<socket_ptr> writers;
+  for (size_t i(0u); i != 3u; ++i)
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+    readers.push_back(socket_ptr(new socket(io, fds[0])));
+    writers.push_back(socket_ptr(new socket(io, fds[1])));
+    char const c( 'x' );
+    BOOST_REQUIRE(writers.back()->write(&c, &c + 1) == &c + 1);
+    readers.back()->request(socket::readable);
+  }
+  readers[0].reset();                           // the last dirty socket takes its place
+  writers[0].reset();
+  io.wait(0u);
+  BOOST_REQUIRE(!io.empty());
+  socket * const survivor( readers[1].get() );
+  readers[2].reset();                           // its event goes, too
+  socket * s;
+  typename socket::event_set ev;
+  BOOST_REQUIRE(io.pop_event(s, ev));
+  BOOST_REQUIRE(s == survivor);
+  BOOST_REQUIRE_EQUAL(ev, socket::readable);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
 }
 
 BOOST_AUTO_TEST_CASE( test_demux_archetype )
@@ -153,6 +280,110 @@ BOOST_AUTO_TEST_CASE( test_demux_archetype )
 BOOST_AUTO_TEST_CASE( test_epoll_demux )
 {
   test_demux<ioxx::detail::epoll>();
+  report_hangups<ioxx::detail::epoll>(true, true);
+}
+
+BOOST_AUTO_TEST_CASE( test_epoll_event_array_grows )
+{
+  typedef ioxx::detail::epoll           demux;
+  typedef demux::socket                 socket;
+  typedef boost::shared_ptr<socket>     socket_ptr;
+
+  demux io(2u, 8u);
+  std::vector<socket_ptr> readers;
+  std::vector<socket_ptr> writers;
+  for (size_t i(0u); i != 5u; ++i)
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+    readers.push_back(socket_ptr(new socket(io, fds[0], socket::readable)));
+    writers.push_back(socket_ptr(new socket(io, fds[1])));
+    char const c( 'x' );
+    BOOST_REQUIRE(writers.back()->write(&c, &c + 1) == &c + 1);
+  }
+  size_t const expected[] = { 2u, 4u, 5u, 5u };
+  size_t const capacity[] = { 4u, 8u, 8u, 8u };
+  for (size_t i(0u); i != 4u; ++i)
+  {
+    io.wait(0u);
+    BOOST_REQUIRE_EQUAL(io.pop_batch().size(), expected[i]);
+    BOOST_REQUIRE_EQUAL(io.batch_capacity(), capacity[i]);
+  }
+  BOOST_REQUIRE_EQUAL(io.waits(), 4u);
+  BOOST_REQUIRE_EQUAL(io.events_received(), 16u);
+  BOOST_REQUIRE_EQUAL(io.full_batches(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE( test_epoll_batch )
+{
+  typedef ioxx::detail::epoll           demux;
+  typedef demux::socket                 socket;
+
+  demux io;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  socket reader(io, fds[0], socket::readable);
+  socket * writer( new socket(io, fds[1], socket::writable) );
+  char const c( 'x' );
+  BOOST_REQUIRE(writer->write(&c, &c + 1) == &c + 1);
+  io.wait(0u);
+  demux::batch const b( io.pop_batch() );
+  BOOST_REQUIRE_EQUAL(b.size(), 2u);
+  BOOST_REQUIRE(io.empty());
+  size_t reads( 0u ), writes( 0u );
+  for (size_t i(0u); i != b.size(); ++i)        // reads first ...
+    if (b.socket_at(i) && b.events_at(i) & socket::readable) { BOOST_REQUIRE(b.socket_at(i) == &reader); ++reads; }
+  delete writer;                                // ... and the writer is gone by now
+  for (size_t i(0u); i != b.size(); ++i)
+    if (b.socket_at(i) && b.events_at(i) & socket::writable) ++writes;
+  BOOST_REQUIRE_EQUAL(reads, 1u);
+  BOOST_REQUIRE_EQUAL(writes, 0u);
+  io.unpop_batch(b, 0u);
+  BOOST_REQUIRE(!io.empty());
+  socket * s;
+  socket::event_set ev;
+  BOOST_REQUIRE(io.pop_event(s, ev));
+  BOOST_REQUIRE(s == &reader);
+  BOOST_REQUIRE_EQUAL(ev, socket::readable);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
+}
+
+BOOST_AUTO_TEST_CASE( test_epoll_forgets_queued_sockets )
+{
+  forget_queued_sockets<ioxx::detail::epoll>();
+}
+
+BOOST_AUTO_TEST_CASE( test_epoll_busy_poll )
+{
+  typedef ioxx::detail::epoll           demux;
+  typedef demux::socket                 socket;
+
+  demux io;
+  io.busy_poll(2000u);
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  socket reader(io, fds[0], socket::readable);
+  socket writer(io, fds[1]);
+  io.wait(10u);                                 // spins in vain, then sleeps
+  BOOST_REQUIRE(io.empty());
+  BOOST_REQUIRE(io.spin_time() >= 2000u);
+  BOOST_REQUIRE(io.sleep_time() > 0u);
+  BOOST_REQUIRE_EQUAL(io.spin_window(), 1000u);
+  BOOST_REQUIRE(io.spin_polls() > 0u);
+  BOOST_REQUIRE_EQUAL(io.waits(), 1u);          // the empty spin polls don't count
+  boost::uint64_t const slept( io.sleep_time() );
+  char const c( 'x' );
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  io.wait(1000u);                               // the spin finds the event
+  BOOST_REQUIRE_EQUAL(io.sleep_time(), slept);
+  BOOST_REQUIRE_EQUAL(io.spin_window(), 2000u);
+  BOOST_REQUIRE_EQUAL(io.waits(), 2u);
+  BOOST_REQUIRE_EQUAL(io.events_received(), 1u);
+  socket * s;
+  socket::event_set ev;
+  BOOST_REQUIRE(io.pop_event(s, ev));
+  BOOST_REQUIRE(s == &reader);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
 }
 #endif
 
@@ -162,6 +393,141 @@ BOOST_AUTO_TEST_CASE( test_epoll_demux )
 BOOST_AUTO_TEST_CASE( test_poll_demux )
 {
   test_demux< ioxx::detail::poll<> >();
+#if defined POLLRDHUP
+  report_hangups< ioxx::detail::poll<> >(true, true);
+#else
+  report_hangups< ioxx::detail::poll<> >(true, false);
+#endif
+}
+#endif
+
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+#  include <ioxx/detail/io_uring.hpp>
+
+BOOST_AUTO_TEST_CASE( test_io_uring_demux )
+{
+  test_demux<ioxx::detail::io_uring>();
+  report_hangups<ioxx::detail::io_uring>(true, true);
+}
+
+BOOST_AUTO_TEST_CASE( test_io_uring_forgets_queued_sockets )
+{
+  forget_queued_sockets<ioxx::detail::io_uring>();
+}
+
+// A level-triggered socket reports unread data again; changing its interest
+// replaces the poll in flight, and the completion of the old one is ignored.
+
+BOOST_AUTO_TEST_CASE( test_io_uring_rearms_polls )
+{
+  typedef ioxx::detail::io_uring        demux;
+  typedef demux::socket                 socket;
+
+  demux io;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  socket reader(io, fds[0], socket::readable);
+  socket writer(io, fds[1], socket::writable);
+  socket * s;
+  socket::event_set ev;
+  io.wait(0u);
+  BOOST_REQUIRE(io.pop_event(s, ev));
+  BOOST_REQUIRE(s == &writer);
+  BOOST_REQUIRE_EQUAL(ev, socket::writable);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
+  writer.request(socket::no_events);
+  char const c( 'x' );
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  for (size_t i(0u); i != 3u; ++i)
+  {
+    io.wait(1000u);
+    BOOST_REQUIRE(io.pop_event(s, ev));
+    BOOST_REQUIRE(s == &reader);
+    BOOST_REQUIRE_EQUAL(ev, socket::readable);
+    BOOST_REQUIRE(!io.pop_event(s, ev));
+  }
+  reader.request(socket::pridata);
+  io.wait(0u);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
+  reader.request(socket::no_events);
+  io.wait(0u);
+  BOOST_REQUIRE(io.empty());
+}
+
+// An edge-triggered socket has one multishot poll for its whole life.
+
+// Destroying sockets only queues the removal of their polls, so the
+// destructors never have to submit a full queue.
+
+BOOST_AUTO_TEST_CASE( test_io_uring_destroys_polls_in_flight )
+{
+  typedef ioxx::detail::io_uring        demux;
+  typedef demux::socket                 socket;
+  typedef boost::shared_ptr<socket>     socket_ptr;
+
+  demux io(4u);
+  std::vector<socket_ptr> readers;
+  std::vector<socket_ptr> writers;
+  for (size_t i(0u); i != 8u; ++i)
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+    readers.push_back(socket_ptr(new socket(io, fds[0], socket::readable)));
+    writers.push_back(socket_ptr(new socket(io, fds[1])));
+  }
+  io.wait(0u);                                  // eight polls in flight
+  BOOST_REQUIRE(io.empty());
+  readers.clear();
+  io.wait(0u);
+  BOOST_REQUIRE(io.empty());
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  socket reader(io, fds[0], socket::readable);
+  socket writer(io, fds[1]);
+  char const c( 'x' );
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  socket * s( 0 );
+  socket::event_set ev;
+  for (size_t i(0u); i != 4u && !s; ++i)        // the cancelled polls may complete first
+  {
+    io.wait(1000u);
+    if (!io.pop_event(s, ev)) s = 0;
+  }
+  BOOST_REQUIRE(s == &reader);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
+}
+
+BOOST_AUTO_TEST_CASE( test_io_uring_multishot )
+{
+  typedef ioxx::detail::io_uring        demux;
+  typedef demux::socket                 socket;
+
+  demux io;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  socket reader(io, fds[0], socket::readable, socket::edge_triggered);
+  ioxx::system_socket writer(fds[1]);
+  socket * s;
+  socket::event_set ev;
+  io.wait(0u);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
+  char const c( 'x' );
+  for (size_t i(0u); i != 3u; ++i)
+  {
+    BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+    io.wait(1000u);
+    BOOST_REQUIRE(io.pop_event(s, ev));
+    BOOST_REQUIRE(s == &reader);
+    BOOST_REQUIRE_EQUAL(ev, socket::readable);
+    io.wait(0u);
+    BOOST_REQUIRE(!io.pop_event(s, ev));  // unread data doesn't trigger again
+  }
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  io.wait(1000u);
+  BOOST_REQUIRE(io.pop_event(s, ev));           // completions of one socket merge
+  BOOST_REQUIRE(s == &reader);
+  BOOST_REQUIRE(!io.pop_event(s, ev));
 }
 #endif
 
@@ -171,5 +537,6 @@ BOOST_AUTO_TEST_CASE( test_poll_demux )
 BOOST_AUTO_TEST_CASE( test_select_demux )
 {
   test_demux<ioxx::detail::select>();
+  report_hangups<ioxx::detail::select>(false, false);
 }
 #endif
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ioxx/dispatch.hpp>
+#include <ioxx/fd_map.hpp>
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+#  include <ioxx/detail/io_uring.hpp>
+#endif
+#include <ioxx/time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+
+static size_t const pipes        = 128u;        // what the first wait() of detail::epoll reports
+static size_t const rounds       = 20000u;
+static size_t const entries      = 10000u;
+static size_t const lookups      = 10000000u;
+
+class stopwatch
+{
+public:
+  stopwatch() { _clock.update(); _start = _clock.current_timeval(); }
+
+  double elapsed()
+  {
+    _clock.update();
+    ioxx::timeval const & now( _clock.current_timeval() );
+    return (now.tv_sec - _start.tv_sec) + (now.tv_usec - _start.tv_usec) / 1e6;
+  }
+
+private:
+  ioxx::time_of_day     _clock;
+  ioxx::timeval         _start;
+};
+
+struct counter
+{
+  explicit counter(size_t & n) : _n(&n) { }
+  template <class Event> void operator() (Event) const { ++(*_n); }
+  size_t * _n;
+};
+
+// Every pipe has data, so every wait() reports all readers, and run() looks
+// up the handler of each one. The lookup test runs on a map with as many
+// entries as a busy server has connections. The io_uring row uses the same
+// flat map as the one above it, so the difference is the demultiplexer.
+
+template <class Dispatch>
+void benchmark(char const * name)
+{
+  typedef typename Dispatch::socket             event_socket;
+  typedef boost::shared_ptr<event_socket>       socket_ptr;
+  typedef boost::shared_ptr<ioxx::system_socket> system_socket_ptr;
+  typedef typename Dispatch::handler_map        handler_map;
+
+  size_t delivered( 0u );
+  double t_register, t_dispatch, t_lookup;
+  {
+    Dispatch disp;
+    std::vector<socket_ptr> readers;
+    std::vector<system_socket_ptr> writers;
+    std::vector<int> fds;
+    for (size_t i(0u); i != pipes; ++i)
+    {
+      int p[2];
+      ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, p));
+      fds.push_back(p[0]);
+      writers.push_back(system_socket_ptr(new ioxx::system_socket(p[1])));
+      char const c( 'x' );
+      if (writers.back()->write(&c, &c + 1) != &c + 1) std::abort();
+    }
+
+    stopwatch register_time;
+    for (size_t r(0u); r != 10u; ++r)
+    {
+      readers.clear();
+      for (size_t i(0u); i != pipes; ++i)
+      {
+        readers.push_back(socket_ptr(new event_socket(disp, fds[i], counter(delivered), event_socket::readable)));
+        readers.back()->close_on_destruction(false);
+      }
+    }
+    t_register = register_time.elapsed();
+
+    stopwatch dispatch_time;
+    for (size_t r(0u); r != rounds; ++r)
+    {
+      disp.wait(0u);
+      disp.run();
+    }
+    t_dispatch = dispatch_time.elapsed();
+
+    readers.clear();
+    for (size_t i(0u); i != pipes; ++i)
+      ::close(fds[i]);
+  }
+  if (delivered != pipes * rounds) std::abort();
+
+  {
+    handler_map m;
+    std::srand(42);
+    for (size_t i(0u); i != entries; ++i)
+      m.insert(std::make_pair(static_cast<ioxx::native_socket_t>(3u + i), typename Dispatch::handler(counter(delivered))));
+    std::vector<ioxx::native_socket_t> keys;
+    for (size_t i(0u); i != 4096u; ++i)
+      keys.push_back(static_cast<ioxx::native_socket_t>(3u + std::rand() % entries));
+    size_t found( 0u );
+    stopwatch lookup_time;
+    for (size_t i(0u); i != lookups; ++i)
+      if (m.find(keys[i % keys.size()]) != m.end()) ++found;
+    t_lookup = lookup_time.elapsed();
+    if (found != lookups) std::abort();
+  }
+
+  std::cout << std::setw(14) << std::left << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << t_register
+            << std::setw(10) << t_dispatch
+            << std::setw(10) << t_lookup
+            << std::endl;
+}
+
+int main(int, char **)
+{
+  typedef ioxx::dispatch<>                                              default_dispatch;
+  typedef default_dispatch::demux                                       demux;
+  typedef default_dispatch::handler                                     handler;
+  typedef ioxx::fd_map<ioxx::native_socket_t, handler>                  flat_map;
+  typedef std::map<ioxx::native_socket_t, handler>                      tree_map;
+  typedef ioxx::dispatch<std::allocator<void>, demux, handler, flat_map> flat_dispatch;
+  typedef ioxx::dispatch<std::allocator<void>, demux, handler, tree_map> tree_dispatch;
+
+  std::cout << pipes << " readable sockets: " << 10u * pipes << " registrations, "
+            << rounds << " dispatch rounds; " << lookups << " lookups among "
+            << entries << " entries; times in seconds" << std::endl
+            << std::setw(14) << std::left << "dispatch" << std::right
+            << std::setw(10) << "register"
+            << std::setw(10) << "dispatch"
+            << std::setw(10) << "lookup"
+            << std::endl;
+  benchmark<tree_dispatch>("std::map");
+  benchmark<flat_dispatch>("fd_map");
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+  typedef ioxx::detail::io_uring                                        uring_demux;
+  typedef ioxx::dispatch<std::allocator<void>, uring_demux>::handler    uring_handler;
+  typedef ioxx::fd_map<ioxx::native_socket_t, uring_handler>            uring_map;
+  benchmark< ioxx::dispatch<std::allocator<void>, uring_demux, uring_handler, uring_map> >("io_uring");
+#endif
+  return 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ioxx/dispatch.hpp>
+#if defined IOXX_HAVE_POLL && IOXX_HAVE_POLL
+#  include <ioxx/detail/poll.hpp>
+#endif
+#if defined IOXX_HAVE_SELECT && IOXX_HAVE_SELECT
+#  include <ioxx/detail/select.hpp>
+#endif
+#include <boost/shared_ptr.hpp>
+#include <vector>
+#include <unistd.h>
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+
+typedef ioxx::dispatch<>                                dispatch;
+typedef dispatch::socket                                event_socket;
+typedef boost::shared_ptr<ioxx::system_socket>          system_socket_ptr;
+
+template <class Dispatch>
+struct pipe_fixture
+{
+  typedef typename Dispatch::socket                     socket;
+  typedef boost::shared_ptr<socket>                     socket_ptr;
+
+  pipe_fixture(Dispatch & disp, size_t n, typename socket::handler const & f)
+  {
+    for (size_t i(0u); i != n; ++i)
+    {
+      int fds[2];
+      ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+      readers.push_back(socket_ptr(new socket(disp, fds[0], f, socket::readable)));
+      writers.push_back(system_socket_ptr(new ioxx::system_socket(fds[1])));
+    }
+  }
+
+  void fill()
+  {
+    char const c( 'x' );
+    for (size_t i(0u); i != writers.size(); ++i)
+      BOOST_REQUIRE(writers[i]->write(&c, &c + 1) == &c + 1);
+  }
+
+  std::vector<socket_ptr>               readers;
+  std::vector<system_socket_ptr>        writers;
+};
+
+struct count_events
+{
+  explicit count_events(size_t & n) : _n(&n) { }
+  template <class Event> void operator() (Event) const { ++(*_n); }
+  size_t * _n;
+};
+
+BOOST_AUTO_TEST_CASE( test_bounded_dispatch_run )
+{
+  dispatch disp;
+  size_t delivered( 0u );
+  pipe_fixture<dispatch> pipes(disp, 4u, count_events(delivered));
+  BOOST_REQUIRE_EQUAL(disp.size(), 4u);
+  pipes.fill();
+  disp.wait(1000u);
+  BOOST_REQUIRE(disp.pending());
+  disp.run(3u);
+  BOOST_REQUIRE_EQUAL(delivered, 3u);
+  BOOST_REQUIRE(disp.pending());
+  disp.wait(1000u);                     // returns at once; events are left over
+  disp.run(3u);
+  BOOST_REQUIRE_EQUAL(delivered, 4u);
+  BOOST_REQUIRE(!disp.pending());
+}
+
+// The first handler to run closes all other readers and opens a new pipe,
+// which re-uses one of their descriptors. None of the events that are
+// still queued for the old sockets may reach anybody.
+
+template <class Dispatch>
+struct close_others
+{
+  typedef typename Dispatch::socket socket;
+
+  close_others(Dispatch & disp, size_t n) : delivered(0u), pipes(disp, n, typename socket::handler()), _disp(&disp)
+  {
+    for (size_t i(0u); i != n; ++i)
+      pipes.readers[i]->modify(boost::bind(&close_others::handle, this, i, _1));
+  }
+
+  void handle(size_t self, typename socket::event_set)
+  {
+    ++delivered;
+    for (size_t i(0u); i != pipes.readers.size(); ++i)
+      if (i != self) pipes.readers[i].reset();
+    pipe_fixture<Dispatch> fresh(*_disp, 1u, count_events(delivered));    // re-uses a descriptor
+    fresh.fill();
+    pipes.readers.push_back(fresh.readers[0]);
+    pipes.writers.push_back(fresh.writers[0]);
+  }
+
+  size_t                        delivered;
+  pipe_fixture<Dispatch>        pipes;
+
+private:
+  Dispatch *                    _disp;
+};
+
+template <class Dispatch>
+void destroy_sockets_within_a_batch()
+{
+  Dispatch disp;
+  close_others<Dispatch> f(disp, 4u);
+  f.pipes.fill();
+  disp.wait(1000u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(f.delivered, 1u);
+  BOOST_REQUIRE(!disp.pending());
+}
+
+// A connection that doesn't know about reference counting: it owns its
+// socket, and it deletes itself when the peer has spoken.
+
+template <class Dispatch>
+class plain_connection
+{
+public:
+  typedef typename Dispatch::socket socket;
+
+  plain_connection(Dispatch & disp, ioxx::native_socket_t fd, bool & destroyed)
+  : _disp(disp), _sock(disp, fd, boost::bind(&plain_connection::run, this, _1), socket::readable), _destroyed(destroyed)
+  {
+  }
+
+  ~plain_connection() { _destroyed = true; }
+
+private:
+  void run(typename socket::event_set)
+  {
+    _disp.dispose(this);
+    BOOST_REQUIRE(!_destroyed);
+  }
+
+  Dispatch &    _disp;
+  socket        _sock;
+  bool &        _destroyed;
+};
+
+// A connection that is kept alive only by the handler of its own socket.
+
+template <class Dispatch>
+class suicidal_connection
+{
+public:
+  typedef typename Dispatch::socket     socket;
+  typedef boost::shared_ptr<socket>     socket_ptr;
+
+  static void create(Dispatch & disp, ioxx::native_socket_t fd, bool & destroyed)
+  {
+    boost::shared_ptr<suicidal_connection> p( new suicidal_connection(destroyed) );
+    p->_sock.reset(new socket(disp, fd, boost::bind(&suicidal_connection::run, p, _1), socket::readable));
+  }
+
+  ~suicidal_connection() { _destroyed = true; }
+
+private:
+  explicit suicidal_connection(bool & destroyed) : _destroyed(destroyed) { }
+
+  void run(typename socket::event_set)
+  {
+    _sock.reset();                      // releases the last reference to this
+    BOOST_REQUIRE(!_destroyed);
+  }
+
+  socket_ptr    _sock;
+  bool &        _destroyed;
+};
+
+template <class Dispatch>
+void destroy_connections_from_within()
+{
+  Dispatch disp;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  bool plain_destroyed( false );
+  new plain_connection<Dispatch>(disp, fds[0], plain_destroyed);
+  ioxx::system_socket writer( fds[1] );
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  bool suicide_destroyed( false );
+  suicidal_connection<Dispatch>::create(disp, fds[0], suicide_destroyed);
+  ioxx::system_socket suicide_writer( fds[1] );
+  char const c( 'x' );
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  BOOST_REQUIRE(suicide_writer.write(&c, &c + 1) == &c + 1);
+  disp.wait(1000u);
+  disp.run();
+  BOOST_REQUIRE(plain_destroyed);
+  BOOST_REQUIRE(suicide_destroyed);
+  BOOST_REQUIRE(disp.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_destroy_sockets_within_a_batch )
+{
+  destroy_sockets_within_a_batch<dispatch>();
+  destroy_connections_from_within<dispatch>();
+#if defined IOXX_HAVE_POLL && IOXX_HAVE_POLL
+  typedef ioxx::dispatch< std::allocator<void>, ioxx::detail::poll<> > poll_dispatch;
+  destroy_sockets_within_a_batch<poll_dispatch>();
+  destroy_connections_from_within<poll_dispatch>();
+#endif
+#if defined IOXX_HAVE_SELECT && IOXX_HAVE_SELECT
+  typedef ioxx::dispatch< std::allocator<void>, ioxx::detail::select > select_dispatch;
+  destroy_sockets_within_a_batch<select_dispatch>();
+  destroy_connections_from_within<select_dispatch>();
+#endif
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+  typedef ioxx::dispatch< std::allocator<void>, ioxx::detail::io_uring > io_uring_dispatch;
+  destroy_sockets_within_a_batch<io_uring_dispatch>();
+  destroy_connections_from_within<io_uring_dispatch>();
+#endif
+}
+
+#if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
+BOOST_AUTO_TEST_CASE( test_edge_triggered_socket )
+{
+  int fds[2];
+  ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+  dispatch disp;
+  size_t reads( 0u ), writes( 0u );
+  event_socket reader(disp, fds[0], count_events(reads), event_socket::readable, ioxx::detail::epoll::socket::edge_triggered);
+  event_socket writer(disp, fds[1], count_events(writes), event_socket::no_events, ioxx::detail::epoll::socket::edge_triggered);
+  disp.wait(0u);
+  disp.run();                           // the writer's edge is remembered
+  BOOST_REQUIRE_EQUAL(writes, 0u);
+  BOOST_REQUIRE(!disp.pending());
+  writer.request(event_socket::writable);
+  BOOST_REQUIRE(disp.pending());        // no need to ask the kernel
+  disp.run();
+  BOOST_REQUIRE_EQUAL(writes, 1u);
+  writer.request(event_socket::no_events);
+  char const c( 'x' );
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  disp.wait(1000u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(reads, 1u);
+  disp.wait(0u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(reads, 1u);       // unread data doesn't trigger again
+  BOOST_REQUIRE(writer.write(&c, &c + 1) == &c + 1);
+  disp.wait(1000u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(reads, 2u);
+}
+
+struct throw_once
+{
+  explicit throw_once(size_t & n) : _n(&n) { }
+  template <class Event> void operator() (Event) const { if (!(*_n)++) throw std::runtime_error("handler failed"); }
+  size_t * _n;
+};
+
+BOOST_AUTO_TEST_CASE( test_exception_within_a_batch )
+{
+  dispatch disp;
+  size_t delivered( 0u );
+  pipe_fixture<dispatch> pipes(disp, 3u, throw_once(delivered));
+  pipes.fill();
+  disp.wait(0u);
+  BOOST_REQUIRE_THROW(disp.run(), std::runtime_error);
+  BOOST_REQUIRE_EQUAL(delivered, 1u);
+  BOOST_REQUIRE(disp.pending());        // the rest of the batch is still queued
+  disp.run();
+  BOOST_REQUIRE_EQUAL(delivered, 3u);
+  BOOST_REQUIRE(!disp.pending());
+}
+
+BOOST_AUTO_TEST_CASE( test_batched_interest_changes )
+{
+  dispatch disp;
+  size_t delivered( 0u );
+  pipe_fixture<dispatch> pipes(disp, 1u, count_events(delivered));
+  size_t const avoided( disp.get_demux().ctl_calls_avoided() );
+  pipes.readers[0]->request(event_socket::no_events);
+  pipes.readers[0]->request(event_socket::readable);
+  pipes.readers[0]->request(event_socket::readable);
+  pipes.fill();
+  disp.wait(0u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(delivered, 1u);
+  BOOST_REQUIRE_EQUAL(disp.get_demux().ctl_calls_avoided(), avoided + 3u);
+  pipes.readers[0]->request(event_socket::no_events);
+  disp.wait(0u);                        // applies the change
+  disp.run();
+  BOOST_REQUIRE_EQUAL(delivered, 1u);
+  BOOST_REQUIRE_EQUAL(disp.get_demux().ctl_calls_avoided(), avoided + 3u);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( test_dispatch_stats )
+{
+  typedef ioxx::dispatch< std::allocator<void>
+                        , ioxx::default_demux< std::allocator<void> >::type
+                        , event_socket::handler
+                        , ioxx::default_handler_map< std::allocator<void>, event_socket::handler >::type
+                        , ioxx::loop_stats
+                        > stats_dispatch;
+  stats_dispatch disp;
+  size_t delivered( 0u );
+  pipe_fixture<stats_dispatch> pipes(disp, 3u, count_events(delivered));
+  pipes.fill();
+  disp.wait(1000u);
+  disp.run();
+  BOOST_REQUIRE_EQUAL(delivered, 3u);
+  disp.wait(0u);
+  ioxx::loop_stats const & stats( disp.dispatch_stats() );
+  BOOST_REQUIRE_EQUAL(stats.wait_time().samples(), 2u);
+  BOOST_REQUIRE_EQUAL(stats.handler_time().samples(), 3u);
+  BOOST_REQUIRE_EQUAL(stats.events_per_wait().samples(), 2u);
+  BOOST_REQUIRE_EQUAL(stats.events_per_wait().sum(), 3u);
+  BOOST_REQUIRE_EQUAL(stats.events_per_wait().count(ioxx::histogram::bucket(3u)), 1u);
+#if defined IOXX_HAVE_EPOLL && IOXX_HAVE_EPOLL
+  BOOST_REQUIRE_EQUAL(stats.ctl_calls(), disp.get_demux().ctl_calls());
+  BOOST_REQUIRE(stats.ctl_calls() >= 3u);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE( test_fd_map )
+{
+  typedef ioxx::fd_map<ioxx::native_socket_t, size_t> fd_map;
+
+  fd_map m;
+  BOOST_REQUIRE(m.empty());
+  BOOST_REQUIRE(m.find(0) == m.end());
+  std::pair<fd_map::iterator,bool> const r( m.insert(std::make_pair(3, 30u)) );
+  BOOST_REQUIRE(r.second);
+  BOOST_REQUIRE(!m.insert(std::make_pair(3, 31u)).second);
+  BOOST_REQUIRE(m.insert(std::make_pair(1000, 10000u)).second);   // grows; r.first stays valid
+  BOOST_REQUIRE_EQUAL(m.size(), 2u);
+  BOOST_REQUIRE(m.find(3) == r.first);
+  BOOST_REQUIRE_EQUAL(r.first->second, 30u);
+  BOOST_REQUIRE_EQUAL(m.find(1000)->second, 10000u);
+  BOOST_REQUIRE(m.find(4) == m.end());
+  BOOST_REQUIRE(m.find(5000) == m.end());
+  m.erase(r.first);
+  BOOST_REQUIRE(m.find(3) == m.end());
+  BOOST_REQUIRE_EQUAL(m.size(), 1u);
+}
@@ -67,7 +67,7 @@ BOOST_AUTO_TEST_CASE( test_dns_resolver )
 {
 #if defined IOXX_HAVE_ADNS && IOXX_HAVE_ADNS
   ioxx::time_of_day    now;
-  ioxx::dns::schedule  schedule(now.current_time_t());
+  ioxx::dns::schedule  schedule(now.current_monotonic_time());
   ioxx::dns::dispatch  dispatch;
   ioxx::dns            dns(schedule, dispatch, now.current_timeval());
 
@@ -77,9 +77,9 @@ BOOST_AUTO_TEST_CASE( test_dns_resolver )
   for (;;)
   {
     dispatch.run();
-    schedule.run();             // TODO: Bah! dns::cun() should return a second_t.
+    schedule.run();             // TODO: Bah! dns::cun() should return a milliseconds_t.
     dns.run();
-    ioxx::seconds_t timeout( schedule.run() );
+    ioxx::milliseconds_t timeout( schedule.run() );
     if (schedule.empty())
     {
       if (dispatch.empty())  break;
@@ -19,8 +19,8 @@
 #define IOXX_TEST_ECHO_HPP_INCLUDED_2010_02_23
 
 #include <ioxx/core.hpp>
+#include <ioxx/buffer_pool.hpp>
 #include <boost/enable_shared_from_this.hpp>
-#include <boost/array.hpp>
 #include <boost/scoped_ptr.hpp>
 
 template <class IOCore>
@@ -35,16 +35,24 @@ public:
   typedef typename socket::address      address;
   typedef typename socket::native_t     native_socket_t;
 
-  static void accept(io_core & io, native_socket_t s, address const & peer)
+  static void accept(io_core & io, ioxx::buffer_pool & pool, native_socket_t s, address const & peer)
   {
     boost::shared_ptr<echo> p;
-    p.reset(new echo(io, s, peer));
+    p.reset(new echo(io, pool, s, peer));
     io.query_ptr(peer, boost::bind(&echo::start, p, _1));
   }
 
+  ~echo()
+  {
+    release_buffer();
+  }
+
 private:
-  echo(io_core & io, native_socket_t s, address const & addr)
-  : _sock(new socket(io, s)), _timeout(io), _peer(addr), _data_begin(&_buf[0]), _data_end(&_buf[0])
+  // The connection holds a buffer from the pool only while it has data to
+  // echo.
+
+  echo(io_core & io, ioxx::buffer_pool & pool, native_socket_t s, address const & addr)
+  : _sock(new socket(io, s)), _timeout(io), _peer(addr), _pool(pool), _buf(0), _data_begin(0), _data_end(0)
   {
     LOGXX_GET_TARGET(LOGXX_SCOPE_NAME, "ioxx.echo(" + ioxx::detail::show(s) + ')');
     LOGXX_TRACE("received echo request from " << addr);
@@ -54,22 +62,31 @@ private:
   {
     LOGXX_INFO("peer " << _peer << " resolves to \"" << (peer ? *peer : "NONE") << '"');
     _sock->modify(boost::bind(&echo::run, this->shared_from_this(), _1), socket::readable);;
-    _timeout.in(10u, boost::bind(&echo::shutdown, this->shared_from_this()));
+    _timeout.in(10000u, boost::bind(&echo::shutdown, this->shared_from_this()), 1000u);
   }
 
   void run(event_set ev)
   {
     try
     {
+      if (ev & (socket::hangup | socket::error)) return shutdown(); // peer is gone
       if (ev & socket::readable)
       {
-        BOOST_ASSERT(_data_begin == _data_end);
-        _data_begin = _buf.begin();
-        _data_end = _sock->read(_buf.begin(), _buf.end());
+        BOOST_ASSERT(!_buf);
+        _buf = _pool.acquire();
+        if (!_buf)
+        {
+          LOGXX_WARNING("out of receive buffers");
+          return shutdown();
+        }
+        _data_begin = _buf;
+        _data_end = _sock->read(_buf, _buf + _pool.buffer_size());
         if (!_data_end) return shutdown(); // end of input
         BOOST_ASSERT(_data_begin <= _data_end);
         if (_data_begin != _data_end)
           _sock->request(socket::writable);
+        else
+          release_buffer();
       }
       if (ev & socket::writable)
       {
@@ -79,11 +96,11 @@ private:
         BOOST_ASSERT(_data_begin <= _data_end);
         if (_data_begin == _data_end)
         {
-          _data_begin = _data_end = _buf.begin();
+          release_buffer();
           _sock->request(socket::readable);
         }
       }
-      _timeout.in(5u, boost::bind(&echo::shutdown, this->shared_from_this()));
+      _timeout.extend(5000u);
     }
     catch(std::exception const & e)
     {
@@ -97,13 +114,23 @@ private:
     LOGXX_TRACE("shut down");
     _timeout.cancel();
     _sock.reset();
+    release_buffer();
+  }
+
+  void release_buffer()
+  {
+    if (!_buf) return;
+    _pool.release(_buf);
+    _buf = 0;
+    _data_begin = _data_end = 0;
   }
 
   socket_ptr                    _sock;
   timeout                       _timeout;
   address                       _peer;
 
-  boost::array<char, 1024u>     _buf;
+  ioxx::buffer_pool &           _pool;
+  char *                        _buf;
   char const *                  _data_begin;
   char const *                  _data_end;
 
@@ -17,12 +17,17 @@
 
 #include <ioxx/core.hpp>
 #include <ioxx/acceptor.hpp>
+#include <ioxx/core_group.hpp>
+#include <ioxx/thread_pool.hpp>
 #include "daytime.hpp"
 #include "echo.hpp"
 
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
 #include <boost/pool/pool_alloc.hpp>
+#include <netinet/in.h>
+#include <cstring>
+#include <stdexcept>
 
 static sig_atomic_t stop_service = false;
 static void stop_service_hook(int) { stop_service = true; }
@@ -46,6 +51,9 @@ BOOST_AUTO_TEST_CASE( example_inetd )
   ioxx::throw_errno_if(boost::bind(std::equal_to<sighandler_t>(), _1, SIG_ERR), "signal(2)", bind(&::signal, SIGINT, &stop_service_hook));
   ioxx::throw_errno_if(boost::bind(std::equal_to<sighandler_t>(), _1, SIG_ERR), "signal(2)", bind(&::signal, SIGTERM, &stop_service_hook));
 
+  // Echo connections borrow their buffers from a pool that outlives them.
+  ioxx::buffer_pool echo_buffers(64u, 1024u);
+
   // The main i/o event dispatcher.
   io_core io;
 
@@ -56,15 +64,477 @@ BOOST_AUTO_TEST_CASE( example_inetd )
 
   // Accept echo TCP service.
   acceptor echo_tcp( io, endpoint("127.0.0.1", "8081", socket::stream_service)
-                   , bind(&echo<io_core>::accept, ref(io), _1, _2)
+                   , bind(&echo<io_core>::accept, ref(io), ref(echo_buffers), _1, _2)
                    );
 
   // Shut everything down after 5 seconds.
-  io.in(5, bind(&stop_service_hook, 0));
+  io.in(5000u, bind(&stop_service_hook, 0));
 
   // The main i/o loop.
-  for (ioxx::seconds_t timeout( io.run() ); !stop_service; timeout = io.run())
+  for (ioxx::milliseconds_t timeout( io.run() ); !stop_service; timeout = io.run())
   {
     io.wait(timeout);
   }
 }
+
+// Producers post numbered tasks from their own threads; the core must run
+// all of them, and those of each producer in order.
+
+struct post_test
+{
+  typedef ioxx::core<> io_core;
+
+  static size_t const producers = 4u;
+  static size_t const tasks     = 10000u;
+
+  explicit post_test(io_core & io) : io(io), received(0u), next(producers, 0u), out_of_order(0u) { }
+
+  void receive(size_t producer, size_t seq)
+  {
+    if (seq != next[producer]) ++out_of_order;
+    next[producer] = seq + 1u;
+    ++received;
+  }
+
+  static void set(bool & flag) { flag = true; }
+
+  static void * produce(void * p)
+  {
+    post_test & t( *static_cast<post_test *>(p) );
+    size_t const id( __sync_fetch_and_add(&t.started, 1u) );
+    for (size_t i(0u); i != tasks; ++i)
+      t.io.post(boost::bind(&post_test::receive, &t, id, i));
+    return 0;
+  }
+
+  io_core &             io;
+  size_t                received;
+  std::vector<size_t>   next;
+  size_t                out_of_order;
+  static size_t         started;
+};
+
+size_t post_test::started = 0u;
+
+BOOST_AUTO_TEST_CASE( test_post_from_other_threads )
+{
+  post_test::io_core io;
+  post_test t(io);
+  pthread_t threads[post_test::producers];
+  for (size_t i(0u); i != post_test::producers; ++i)
+    BOOST_REQUIRE_EQUAL(pthread_create(&threads[i], 0, &post_test::produce, &t), 0);
+  for (io.run(); t.received != post_test::producers * post_test::tasks; io.run())
+    io.wait(1000u);             // only the eventfd can wake us up
+  for (size_t i(0u); i != post_test::producers; ++i)
+    BOOST_REQUIRE_EQUAL(pthread_join(threads[i], 0), 0);
+  io.run();
+  BOOST_CHECK_EQUAL(t.received, post_test::producers * post_test::tasks);
+  BOOST_CHECK_EQUAL(t.out_of_order, 0u);
+  BOOST_CHECK(io.empty());
+
+  bool local( false );
+  io.post(boost::bind(&post_test::set, boost::ref(local)));
+  BOOST_CHECK(!io.empty());
+  io.run();
+  BOOST_CHECK(local);
+}
+
+// Jobs run in the pool, their continuations in the thread of the core. A
+// job that blocks one worker must not hold up the jobs queued behind it.
+// Either worker may end up with the blocking job, since the other one can
+// steal it before it starts.
+
+struct pool_test
+{
+  pool_test() : loop(pthread_self()), finished(0u), continued(0u), wrong_thread(0u), blocked(true) { }
+
+  void work()                   { __sync_fetch_and_add(&finished, 1u); }
+  void block()                  { while (const_cast<bool volatile &>(blocked)) ::usleep(1000u); }
+
+  void done()
+  {
+    if (!pthread_equal(pthread_self(), loop)) ++wrong_thread;
+    ++continued;
+  }
+
+  pthread_t     loop;
+  size_t        finished, continued, wrong_thread;
+  bool          blocked;
+};
+
+BOOST_AUTO_TEST_CASE( test_thread_pool )
+{
+  typedef ioxx::core<>                  io_core;
+  typedef ioxx::thread_pool<>           thread_pool;
+
+  io_core io;
+  pool_test t;
+  {
+    thread_pool pool(2u);
+    BOOST_REQUIRE_EQUAL(pool.size(), 2u);
+    pool.submit(boost::bind(&pool_test::block, &t));
+    for (size_t i(0u); i != 100u; ++i)
+      pool.offload(io, boost::bind(&pool_test::work, &t), boost::bind(&pool_test::done, &t));
+    for (io.run(); t.continued != 100u; io.run())
+      io.wait(1000u);
+    BOOST_CHECK_EQUAL(t.finished, 100u);
+    BOOST_CHECK_EQUAL(t.wrong_thread, 0u);
+    BOOST_CHECK(pool.stats(0u).stolen + pool.stats(1u).stolen >= 50u);
+    t.blocked = false;
+  }
+  BOOST_CHECK(io.empty());
+}
+
+// Deferred tasks run right after the event that deferred them, tasks they
+// defer included; idle tasks wait until no event is left over.
+
+struct defer_test
+{
+  typedef ioxx::core<>                  io_core;
+  typedef io_core::socket               socket;
+  typedef boost::shared_ptr<socket>     socket_ptr;
+
+  explicit defer_test(io_core & core) : io(core) { }
+
+  void add_pipe()
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("pipe(2)", boost::bind(boost::type<int>(), &::pipe, fds));
+    readers.push_back(socket_ptr(new socket(io, fds[0], boost::bind(&defer_test::readable, this, readers.size()), socket::readable)));
+    writers.push_back(socket_ptr(new socket(io, fds[1])));
+    char const c( 'x' );
+    BOOST_REQUIRE(writers.back()->write(&c, &c + 1) == &c + 1);
+  }
+
+  void readable(size_t i)
+  {
+    char c;
+    BOOST_REQUIRE(readers[i]->read(&c, &c + 1) == &c + 1);
+    log.push_back(1);
+    io.defer(boost::bind(&defer_test::flush, this));
+  }
+
+  void flush()
+  {
+    log.push_back(2);
+    io.defer(boost::bind(&defer_test::record, this, 3));
+  }
+
+  void record(int n)            { log.push_back(n); }
+
+  void requeue()
+  {
+    log.push_back(7);
+    io.idle(boost::bind(&defer_test::requeue, this));
+  }
+
+  io_core &                     io;
+  std::vector<socket_ptr>       readers, writers;
+  std::vector<int>              log;
+};
+
+BOOST_AUTO_TEST_CASE( test_defer_and_idle )
+{
+  defer_test::io_core io;
+  defer_test t(io);
+  t.add_pipe();
+  t.add_pipe();
+  io.idle(boost::bind(&defer_test::record, &t, 9));
+  BOOST_CHECK(!io.empty());
+  io.wait(1000u);
+  BOOST_CHECK_EQUAL(io.run(1u), 0u);            // an event is left over
+  int const busy[] = { 1, 2, 3 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(t.log.begin(), t.log.end(), busy, busy + 3);
+  io.run();
+  int const idle[] = { 1, 2, 3, 1, 2, 3, 9 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(t.log.begin(), t.log.end(), idle, idle + 7);
+  t.readers.clear();
+  t.writers.clear();
+  BOOST_CHECK(io.empty());
+}
+
+// An idle task that queues itself again runs once per idle pass and doesn't
+// keep the loop from blocking.
+
+BOOST_AUTO_TEST_CASE( test_idle_requeue )
+{
+  defer_test::io_core io;
+  defer_test t(io);
+  t.add_pipe();
+  io.idle(boost::bind(&defer_test::requeue, &t));
+  io.wait(1000u);
+  BOOST_CHECK(io.run() > 0u);
+  int const first[] = { 1, 2, 3, 7 };
+  BOOST_CHECK_EQUAL_COLLECTIONS(t.log.begin(), t.log.end(), first, first + 4);
+  io.wait(0u);
+  BOOST_CHECK(io.run() > 0u);
+  BOOST_CHECK_EQUAL(t.log.size(), 5u);
+  BOOST_CHECK(!io.empty());
+  t.readers.clear();
+  t.writers.clear();
+  io.wait(0u);
+  BOOST_CHECK_EQUAL(io.run(), 0u);              // nothing could end a wait()
+  BOOST_CHECK_EQUAL(t.log.size(), 6u);
+}
+
+// Without io_uring(7), a socket borrows a pool buffer only once it has
+// become readable, and returns it when the handler is done.
+
+struct pool_receive_test
+{
+  pool_receive_test() : received(0), buffer(0) { }
+
+  void receive(int n, char * b)
+  {
+    received = n;
+    buffer   = b;
+    if (b && n > 0) data.assign(b, b + n);
+  }
+
+  int           received;
+  char *        buffer;
+  std::string   data;
+};
+
+BOOST_AUTO_TEST_CASE( test_receive_into_pool )
+{
+  typedef ioxx::core<>                  io_core;
+  typedef io_core::socket               socket;
+
+  ioxx::buffer_pool pool(1u, 64u);
+  io_core io;
+  pool_receive_test t;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("socketpair(2)", boost::bind(boost::type<int>(), &::socketpair, static_cast<int>(AF_UNIX), static_cast<int>(SOCK_STREAM), 0, fds));
+  socket reader(io, fds[0]);
+  reader.set_nonblocking();
+  ioxx::system_socket writer(fds[1]);
+  for (size_t i(0u); i != 3u; ++i)              // the one buffer is used again
+  {
+    t = pool_receive_test();
+    reader.async_receive(pool, boost::bind(&pool_receive_test::receive, &t, _1, _2));
+    io.wait(0u);
+    io.run();
+    BOOST_CHECK_EQUAL(t.received, 0);           // no data, no buffer
+    BOOST_CHECK_EQUAL(pool.available(), 1u);
+    char const msg[] = "ping";
+    BOOST_REQUIRE(writer.write(msg, msg + 4) == msg + 4);
+    for (io.run(); !t.received; io.run())
+      io.wait(1000u);
+    BOOST_REQUIRE_EQUAL(t.received, 4);
+    BOOST_CHECK(t.buffer == pool.buffer(0u));
+    BOOST_CHECK_EQUAL(t.data, "ping");
+    BOOST_CHECK_EQUAL(pool.available(), 1u);
+  }
+  t = pool_receive_test();
+  char * const b( pool.acquire() );
+  reader.async_receive(pool, boost::bind(&pool_receive_test::receive, &t, _1, _2));
+  char const msg[] = "pong";
+  BOOST_REQUIRE(writer.write(msg, msg + 4) == msg + 4);
+  for (io.run(); !t.received; io.run())
+    io.wait(1000u);
+  BOOST_CHECK_EQUAL(t.received, -ENOBUFS);
+  BOOST_CHECK(!t.buffer);
+  pool.release(b);
+}
+
+#if defined IOXX_HAVE_IO_URING && IOXX_HAVE_IO_URING
+
+// Completion-based transfers report byte counts; the handler of an operation
+// that's pending when its socket goes away sees ECANCELED.
+
+struct async_test
+{
+  async_test() : accepted(-1), written(0), received(0), cancelled(0) { }
+
+  void accept(int fd)           { accepted = fd; }
+  void write(int n)             { written = n; }
+  void read(int n)              { received = n; }
+  void cancel(int n)            { cancelled = n; }
+
+  int accepted, written, received, cancelled;
+};
+
+BOOST_AUTO_TEST_CASE( test_async_socket )
+{
+  typedef ioxx::core<>                  io_core;
+  typedef io_core::async_socket         async_socket;
+  typedef ioxx::system_socket::endpoint endpoint;
+
+  io_core io;
+  async_test t;
+  char buf[16];
+  {
+    int fds[2];
+    ioxx::throw_errno_if_minus1("socketpair(2)", boost::bind(boost::type<int>(), &::socketpair, static_cast<int>(AF_UNIX), static_cast<int>(SOCK_STREAM), 0, fds));
+    async_socket a(io, fds[0]);
+    async_socket b(io, fds[1]);
+    char const msg[] = "hello";
+    b.async_read(buf, buf + sizeof(buf), boost::bind(&async_test::read, &t, _1));
+    a.async_write(msg, msg + sizeof(msg) - 1u, boost::bind(&async_test::write, &t, _1));
+    BOOST_CHECK(!io.empty());
+    for (io.run(); !t.received; io.run())
+      io.wait(1000u);
+    BOOST_CHECK_EQUAL(t.written, 5);
+    BOOST_REQUIRE_EQUAL(t.received, 5);
+    BOOST_CHECK_EQUAL(std::string(buf, buf + t.received), "hello");
+    b.async_read(buf, buf + sizeof(buf), boost::bind(&async_test::cancel, &t, _1));
+    io.wait(0u);
+    io.run();
+    BOOST_CHECK_EQUAL(t.cancelled, 0);
+  }
+  for (io.run(); !t.cancelled; io.run())
+    io.wait(1000u);
+  BOOST_CHECK_EQUAL(t.cancelled, -ECANCELED);
+  BOOST_CHECK(io.empty());
+
+  endpoint const addr("127.0.0.1", "8083");
+  async_socket ls(io, addr.create());
+  ls.reuse_bind_address();
+  ls.bind(addr);
+  ls.listen(16u);
+  ls.async_accept(boost::bind(&async_test::accept, &t, _1));
+  io.wait(0u);
+  ioxx::system_socket client(addr.create());
+  ioxx::throw_errno_if_minus1("connect(2)", boost::bind(boost::type<int>(), &::connect, client.as_native_socket_t(), &addr.as_sockaddr(), addr.as_socklen_t()));
+  for (io.run(); t.accepted < 0; io.run())
+    io.wait(1000u);
+  ioxx::system_socket accepted(t.accepted);
+  BOOST_CHECK(io.empty());
+}
+
+// The kernel fills a pool buffer only when data arrives; the buffer goes
+// back into the ring when the handler returns.
+
+struct receive_test
+{
+  receive_test() : received(0), buffer(0) { }
+
+  void receive(int n, char * b)
+  {
+    received = n;
+    buffer   = b;
+    if (b && n > 0) data.assign(b, b + n);
+  }
+
+  int           received;
+  char *        buffer;
+  std::string   data;
+};
+
+BOOST_AUTO_TEST_CASE( test_async_receive )
+{
+  typedef ioxx::core<>                  io_core;
+  typedef io_core::async_socket         async_socket;
+
+  ioxx::buffer_pool pool(4u, 64u);
+  io_core io;
+  receive_test t;
+  int fds[2];
+  ioxx::throw_errno_if_minus1("socketpair(2)", boost::bind(boost::type<int>(), &::socketpair, static_cast<int>(AF_UNIX), static_cast<int>(SOCK_STREAM), 0, fds));
+  async_socket reader(io, fds[0]);
+  ioxx::system_socket writer(fds[1]);
+  for (size_t i(0u); i != 8u; ++i)     // twice as many receives as buffers
+  {
+    t = receive_test();
+    reader.async_receive(pool, boost::bind(&receive_test::receive, &t, _1, _2));
+    BOOST_CHECK_EQUAL(pool.available(), 0u);
+    io.wait(0u);
+    io.run();
+    BOOST_CHECK_EQUAL(t.received, 0);   // no data, no buffer
+    char const msg[] = "ping";
+    BOOST_REQUIRE(writer.write(msg, msg + 4) == msg + 4);
+    for (io.run(); !t.received; io.run())
+      io.wait(1000u);
+    BOOST_REQUIRE_EQUAL(t.received, 4);
+    BOOST_CHECK(t.buffer);
+    BOOST_CHECK_EQUAL(t.data, "ping");
+  }
+  BOOST_CHECK(io.empty());
+}
+
+#endif // IOXX_HAVE_IO_URING
+
+#if defined IOXX_HAVE_REUSEPORT && IOXX_HAVE_REUSEPORT
+
+// Every thread of the group listens on the same port and greets whoever
+// connects to it.
+
+struct greeter
+{
+  typedef ioxx::core<>                  io_core;
+  typedef ioxx::acceptor<>              acceptor;
+  typedef acceptor::socket              socket;
+  typedef acceptor::endpoint            endpoint;
+
+  explicit greeter(io_core & io)
+  : tcp(io, endpoint("127.0.0.1", "8082", socket::stream_service), &greeter::accept, acceptor::shared_port)
+  {
+  }
+
+  static void accept(socket::native_t s, socket::address const &)
+  {
+    ioxx::system_socket sock(s);
+    char const msg[] = "hello";
+    sock.write(msg, msg + sizeof(msg) - 1u);
+  }
+
+  acceptor tcp;
+};
+
+BOOST_AUTO_TEST_CASE( test_core_group )
+{
+  typedef ioxx::core_group<greeter::io_core, greeter> group;
+
+  group g(2u);
+  BOOST_REQUIRE_EQUAL(g.size(), 2u);
+  g.start();
+  BOOST_REQUIRE(g.running());
+  for (size_t i(0u); i != 8u; ++i)
+  {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8082);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ioxx::system_socket client(ioxx::throw_errno_if_minus1("socket(2)", boost::bind(boost::type<int>(), &::socket, AF_INET, SOCK_STREAM, 0)));
+    ioxx::throw_errno_if_minus1("connect(2)", boost::bind(boost::type<int>(), &::connect, client.as_native_socket_t(), reinterpret_cast<sockaddr *>(&addr), sizeof(addr)));
+    char buf[16];
+    char * const p( client.read(buf, buf + sizeof(buf)) );
+    BOOST_REQUIRE(p);
+    BOOST_CHECK_EQUAL(std::string(buf, p), "hello");
+  }
+  g.stop();
+  BOOST_REQUIRE(!g.running());
+  // The acceptor takes connections until accept(2) would block, so one
+  // round may serve several clients, but a thread that served one goes
+  // back to wait() at least once before it sees the stop request.
+  size_t iterations( 0u );
+  for (size_t i(0u); i != g.size(); ++i)
+    iterations += g.stats(i).iterations;
+  BOOST_CHECK(iterations > 0u);
+}
+
+#endif // IOXX_HAVE_REUSEPORT
+
+// A thread whose loop fails takes its core down, and stop() reports it.
+
+struct failing_service
+{
+  typedef ioxx::core<>                  io_core;
+
+  explicit failing_service(io_core & io) { io.post(&failing_service::fail); }
+
+  static void fail() { throw std::runtime_error("service failed"); }
+};
+
+BOOST_AUTO_TEST_CASE( test_core_group_failure )
+{
+  typedef ioxx::core_group<failing_service::io_core, failing_service> group;
+
+  group g(2u);
+  g.start();
+  BOOST_REQUIRE(g.running());
+  BOOST_CHECK_THROW(g.stop(), std::runtime_error);
+  BOOST_CHECK(!g.running());
+}
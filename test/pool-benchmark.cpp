@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ioxx/core.hpp>
+#include <ioxx/thread_pool.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <cstdlib>
+
+static size_t const requests     = 20000u;
+static size_t const heavy_every  = 20u;         // one request in 20 is expensive
+static double const cheap_work   = 20e-6;       // seconds
+static double const heavy_work   = 2e-3;
+static double const interval     = 200e-6;      // between two arrivals
+
+typedef ioxx::core<>            io_core;
+typedef ioxx::thread_pool<>     thread_pool;
+
+static double now()
+{
+  ioxx::time_of_day clock;
+  clock.update();
+  return clock.current_timeval().tv_sec + clock.current_timeval().tv_usec / 1e6;
+}
+
+static void spin(double seconds)
+{
+  for (double const until( now() + seconds ); now() < until; /**/) { }
+}
+
+// Requests arrive at a fixed rate, no matter how far behind the loop is, so
+// that a stalled loop shows up as latency. Cheap requests are answered right
+// away; heavy ones either block the loop or go to the pool.
+
+struct server
+{
+  server() : done(0u) { }
+
+  void respond(double arrival, bool heavy)
+  {
+    if (!heavy) latency.push_back(now() - arrival);
+    ++done;
+  }
+
+  void run(io_core & io, thread_pool * pool)
+  {
+    double const start( now() );
+    for (size_t admitted(0u); done != requests; /**/)
+    {
+      for (double const t( now() ); admitted != requests && start + admitted * interval <= t; ++admitted)
+      {
+        double const arrival( start + admitted * interval );
+        bool const heavy( admitted % heavy_every == 0u );
+        if (heavy && pool)
+          pool->offload(io, boost::bind(&spin, heavy_work), boost::bind(&server::respond, this, arrival, true));
+        else
+        {
+          spin(heavy ? heavy_work : cheap_work);
+          respond(arrival, heavy);
+        }
+      }
+      io.run();
+      io.wait(0u);
+    }
+  }
+
+  size_t                done;
+  std::vector<double>   latency;
+};
+
+static void benchmark(char const * name, thread_pool * pool)
+{
+  io_core io;
+  server s;
+  double const start( now() );
+  s.run(io, pool);
+  double const total( now() - start );
+  std::vector<double> & l( s.latency );
+  std::sort(l.begin(), l.end());
+  std::cout << std::setw(14) << std::left << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << l[l.size() / 2u] * 1e3
+            << std::setw(10) << l[l.size() * 99u / 100u] * 1e3
+            << std::setw(10) << l[l.size() * 999u / 1000u] * 1e3
+            << std::setw(10) << l.back() * 1e3
+            << std::setw(10) << total
+            << std::endl;
+}
+
+int main(int, char **)
+{
+  std::cout << requests << " requests, one in " << heavy_every << " heavy; latency of cheap requests in ms, total in seconds" << std::endl
+            << std::setw(14) << std::left << "heavy jobs" << std::right
+            << std::setw(10) << "median"
+            << std::setw(10) << "99%"
+            << std::setw(10) << "99.9%"
+            << std::setw(10) << "max"
+            << std::setw(10) << "total"
+            << std::endl;
+  benchmark("inline", 0);
+  {
+    thread_pool pool;
+    benchmark("thread_pool", &pool);
+    size_t stolen( 0u );
+    for (size_t i(0u); i != pool.size(); ++i)
+      stolen += pool.stats(i).stolen;
+    std::cout << pool.size() << " workers stole " << stolen << " jobs" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2010 Peter Simons <simons@cryp.to>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ioxx/time.hpp>
+#include <ioxx/schedule.hpp>
+#include <ioxx/timing_wheel.hpp>
+#include <boost/function/function0.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+
+static size_t const live_timers  = 1000000u;
+static size_t const re_arms      = 1000000u;
+static size_t const same_slot    = 10000u;
+static size_t const slot_re_arms = 20000u;
+static size_t const probes       = 10000u;
+static ioxx::milliseconds_t const probe_time = 100000u;
+
+class stopwatch
+{
+public:
+  stopwatch() { _clock.update(); _start = _clock.current_timeval(); }
+
+  double elapsed()
+  {
+    _clock.update();
+    ioxx::timeval const & now( _clock.current_timeval() );
+    return (now.tv_sec - _start.tv_sec) + (now.tv_usec - _start.tv_usec) / 1e6;
+  }
+
+private:
+  ioxx::time_of_day     _clock;
+  ioxx::timeval         _start;
+};
+
+struct counter
+{
+  explicit counter(size_t & n) : _n(&n) { }
+  void operator() () const { ++(*_n); }
+  size_t * _n;
+};
+
+template <class Schedule>
+void benchmark(char const * name)
+{
+  typedef typename Schedule::task_id task_id;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  Schedule sched(now);
+  std::vector<task_id> ids;
+  ids.reserve(live_timers);
+  size_t fired( 0u );
+  std::srand(42);
+
+  stopwatch insert_time;
+  for (size_t i(0u); i != live_timers; ++i)
+    ids.push_back(sched.in(1u + std::rand() % 60000u, counter(fired)));
+  double const t_insert( insert_time.elapsed() );
+
+  stopwatch re_arm_time;
+  for (size_t i(0u); i != re_arms; ++i)
+  {
+    task_id & tid( ids[std::rand() % live_timers] );
+    sched.unsafe_cancel(tid);
+    tid = sched.in(1u + std::rand() % 60000u, counter(fired));
+  }
+  double const t_re_arm( re_arm_time.elapsed() );
+
+  stopwatch expire_time;
+  while (!sched.empty())
+  {
+    ++now;
+    sched.run();
+  }
+  double const t_expire( expire_time.elapsed() );
+
+  if (fired != live_timers) std::abort();
+
+  std::cout << std::setw(14) << std::left << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << t_insert
+            << std::setw(10) << t_re_arm
+            << std::setw(10) << t_expire
+            << std::endl;
+}
+
+// Many timers share one deadline, as when thousands of connections see I/O
+// within the same millisecond. Re-arming through a plain task_id has to find
+// the entry among its equals; schedule::timeout knows where it lives.
+
+template <class Schedule>
+void benchmark_same_deadline(char const * name)
+{
+  typedef typename Schedule::task_id task_id;
+  typedef typename Schedule::timeout timeout;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  size_t fired( 0u );
+  std::srand(42);
+
+  double t_task_id;
+  {
+    Schedule sched(now);
+    std::vector<task_id> ids;
+    for (size_t i(0u); i != same_slot; ++i)
+      ids.push_back(sched.in(1000u, counter(fired)));
+    stopwatch re_arm_time;
+    for (size_t i(0u); i != slot_re_arms; ++i)
+    {
+      task_id & tid( ids[std::rand() % same_slot] );
+      if (!sched.cancel(tid)) std::abort();
+      tid = sched.in(1000u, counter(fired));
+    }
+    t_task_id = re_arm_time.elapsed();
+  }
+
+  double t_timeout, t_extend;
+  {
+    Schedule sched(now);
+    std::vector<timeout *> handles;
+    for (size_t i(0u); i != same_slot; ++i)
+      handles.push_back(new timeout(sched, 1000u, counter(fired)));
+    stopwatch re_arm_time;
+    for (size_t i(0u); i != slot_re_arms; ++i)
+      if (!handles[std::rand() % same_slot]->in(1000u, counter(fired))) std::abort();
+    t_timeout = re_arm_time.elapsed();
+    stopwatch extend_time;
+    for (size_t i(0u); i != slot_re_arms; ++i)
+      if (!handles[std::rand() % same_slot]->extend(1000u + i % 100u)) std::abort();
+    t_extend = extend_time.elapsed();
+    for (size_t i(0u); i != same_slot; ++i)
+      delete handles[i];
+  }
+
+  std::cout << std::setw(14) << std::left << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << t_task_id
+            << std::setw(10) << t_timeout
+            << std::setw(10) << t_extend
+            << std::endl;
+}
+
+// Health probes that run once per second or so, either by re-arming a
+// timeout from within the task or as a periodic task.
+
+struct probe
+{
+  probe() : hits(0u) { }
+  void tick() { ++hits; }
+  size_t hits;
+};
+
+template <class Schedule>
+struct re_arm
+{
+  typedef typename Schedule::timeout timeout;
+
+  void operator() () const
+  {
+    p->tick();
+    t->in(period, *this);
+  }
+
+  timeout *                     t;
+  ioxx::milliseconds_t          period;
+  boost::shared_ptr<probe>      p;
+};
+
+template <class Schedule>
+void benchmark_periodic(char const * name)
+{
+  typedef typename Schedule::timeout  timeout;
+  typedef typename Schedule::periodic periodic;
+
+  boost::shared_ptr<probe> p( new probe );
+  double t_timeout, t_periodic;
+  {
+    ioxx::monotonic_time_t now( 1267401600 );
+    Schedule sched(now);
+    std::vector<timeout *> handles;
+    for (size_t i(0u); i != probes; ++i)
+    {
+      handles.push_back(new timeout(sched));
+      re_arm<Schedule> const f = { handles.back(), static_cast<ioxx::milliseconds_t>(1000u + i % 100u), p };
+      handles.back()->in(f.period, f);
+    }
+    stopwatch run_time;
+    for (ioxx::milliseconds_t i(0u); i != probe_time; ++i)
+    {
+      ++now;
+      sched.run();
+    }
+    t_timeout = run_time.elapsed();
+    for (size_t i(0u); i != probes; ++i)
+      delete handles[i];
+  }
+  size_t const hits( p->hits );
+  {
+    ioxx::monotonic_time_t now( 1267401600 );
+    Schedule sched(now);
+    std::vector<periodic *> handles;
+    for (size_t i(0u); i != probes; ++i)
+      handles.push_back(new periodic(sched, 1000u + i % 100u, boost::bind(&probe::tick, p)));
+    stopwatch run_time;
+    for (ioxx::milliseconds_t i(0u); i != probe_time; ++i)
+    {
+      ++now;
+      sched.run();
+    }
+    t_periodic = run_time.elapsed();
+    for (size_t i(0u); i != probes; ++i)
+      delete handles[i];
+  }
+  if (p->hits != 2u * hits) std::abort();
+
+  std::cout << std::setw(14) << std::left << name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(10) << t_timeout
+            << std::setw(10) << t_periodic
+            << std::endl;
+}
+
+int main(int, char **)
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::schedule<>                                              map_schedule;
+  typedef ioxx::schedule< std::allocator<void>
+                        , task
+                        , ioxx::timing_wheel<ioxx::monotonic_time_t, task>
+                        >                                               wheel_schedule;
+
+  std::cout << live_timers << " live timers, " << re_arms << " re-arms; times in seconds" << std::endl
+            << std::setw(14) << std::left << "queue" << std::right
+            << std::setw(10) << "insert"
+            << std::setw(10) << "re-arm"
+            << std::setw(10) << "expire"
+            << std::endl;
+  benchmark<map_schedule>("multimap");
+  benchmark<wheel_schedule>("timing_wheel");
+
+  std::cout << std::endl
+            << same_slot << " timers on one deadline, " << slot_re_arms << " re-arms; times in seconds" << std::endl
+            << std::setw(14) << std::left << "queue" << std::right
+            << std::setw(10) << "task_id"
+            << std::setw(10) << "timeout"
+            << std::setw(10) << "extend"
+            << std::endl;
+  benchmark_same_deadline<map_schedule>("multimap");
+  benchmark_same_deadline<wheel_schedule>("timing_wheel");
+
+  std::cout << std::endl
+            << probes << " probes for " << probe_time << " ms; times in seconds" << std::endl
+            << std::setw(14) << std::left << "queue" << std::right
+            << std::setw(10) << "re-arm"
+            << std::setw(10) << "periodic"
+            << std::endl;
+  benchmark_periodic<map_schedule>("multimap");
+  benchmark_periodic<wheel_schedule>("timing_wheel");
+  return 0;
+}
@@ -17,10 +17,15 @@
 
 #include <ioxx/time.hpp>
 #include <ioxx/schedule.hpp>
+#include <ioxx/timing_wheel.hpp>
 
 #define BOOST_TEST_MAIN
 #include <boost/test/unit_test.hpp>
+#include <boost/shared_ptr.hpp>
 #include <functional>
+#include <algorithm>
+#include <vector>
+#include <string>
 
 class dummy
 {
@@ -35,24 +40,25 @@ private:
 BOOST_AUTO_TEST_CASE( dummy_schedule_test )
 {
   using ioxx::time_of_day;
-  using ioxx::seconds_t;
+  using ioxx::milliseconds_t;
   typedef ioxx::schedule<> scheduler;
 
   time_of_day now;
-  scheduler schedule(now.current_time_t());
+  scheduler schedule(now.current_monotonic_time());
   size_t dummy_call_counter( 0u );
   BOOST_REQUIRE(schedule.empty());
   BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
   BOOST_REQUIRE_EQUAL(dummy_call_counter, 0u);
-  schedule.at(now.current_time_t(), dummy(dummy_call_counter));
-  schedule.in(1u, dummy(dummy_call_counter));
-  scheduler::task_id tid( schedule.in(5u, dummy(dummy_call_counter)) );
-  seconds_t delay( schedule.run() );
-  BOOST_REQUIRE_EQUAL(delay, 1u);
+  schedule.at(now.current_monotonic_time(), dummy(dummy_call_counter));
+  schedule.in(100u, dummy(dummy_call_counter));
+  scheduler::task_id tid( schedule.in(500u, dummy(dummy_call_counter)) );
+  milliseconds_t delay( schedule.run() );
+  BOOST_REQUIRE_EQUAL(delay, 100u);
   BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
-  sleep(delay); now.update();
+  usleep(delay * 1000u); now.update();
   delay = schedule.run();
-  BOOST_REQUIRE_EQUAL(delay, 4u);
+  BOOST_REQUIRE_PREDICATE(std::less_equal<milliseconds_t>(), (delay)(400u));
+  BOOST_REQUIRE_PREDICATE(std::greater<milliseconds_t>(), (delay)(0u));
   BOOST_REQUIRE_EQUAL(dummy_call_counter, 2u);
   schedule.unsafe_cancel(tid);
   delay = schedule.run();
@@ -65,12 +71,12 @@ BOOST_AUTO_TEST_CASE( test_schedule_timeout )
 {
   ioxx::time_of_day now;
   typedef ioxx::schedule<> scheduler;
-  scheduler schedule(now.current_time_t());
+  scheduler schedule(now.current_monotonic_time());
   size_t dummy_call_counter( 0u );
   {
     scheduler::timeout timeout( schedule );
     BOOST_REQUIRE_EQUAL(dummy_call_counter, 0u);
-    timeout.at(now.current_time_t(), dummy(dummy_call_counter));
+    timeout.at(now.current_monotonic_time(), dummy(dummy_call_counter));
     schedule.run();
     BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
     timeout.in(1u, dummy(dummy_call_counter));
@@ -79,33 +85,314 @@ BOOST_AUTO_TEST_CASE( test_schedule_timeout )
   BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
 }
 
+template <class Schedule>
+void use_timeout_handle()
+{
+  typedef typename Schedule::timeout timeout;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  Schedule schedule(now);
+  size_t dummy_call_counter( 0u );
+  boost::shared_ptr<int> resource( new int(0) );
+  {
+    timeout t1( schedule, 10u, dummy(dummy_call_counter) );
+    timeout t2( schedule );
+    BOOST_REQUIRE(t1.pending());
+    BOOST_REQUIRE(!t2.pending());
+    BOOST_REQUIRE(!t2.cancel());
+    t2.at(now, dummy(dummy_call_counter));
+    BOOST_REQUIRE(t2.in(5u, dummy(dummy_call_counter)));
+    t1.swap(t2);
+    now += 5u;
+    BOOST_REQUIRE_EQUAL(schedule.run(), 5u);
+    BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
+    BOOST_REQUIRE(!t1.pending());
+    BOOST_REQUIRE(t2.pending());
+    BOOST_REQUIRE(!t1.cancel());
+    t1.in(1u, boost::bind(&boost::shared_ptr<int>::use_count, resource));
+    BOOST_REQUIRE_EQUAL(resource.use_count(), 2);
+    BOOST_REQUIRE(t1.cancel());
+    BOOST_REQUIRE_EQUAL(resource.use_count(), 1);
+  }
+  BOOST_REQUIRE(schedule.empty());
+  BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
+}
+
+template <class Schedule>
+void use_lazy_extend()
+{
+  typedef typename Schedule::timeout timeout;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  Schedule schedule(now);
+  size_t dummy_call_counter( 0u );
+  timeout t( schedule, 10u, dummy(dummy_call_counter) );
+  now += 5u;
+  BOOST_REQUIRE(t.extend(10u));
+  now += 5u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 5u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 0u);
+  BOOST_REQUIRE(t.pending());
+  BOOST_REQUIRE(t.extend(2u));
+  now += 2u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
+  BOOST_REQUIRE(!t.pending());
+  BOOST_REQUIRE(!t.extend(1u));
+  BOOST_REQUIRE(schedule.empty());
+}
+
+template <class Schedule>
+void use_slack()
+{
+  typedef typename Schedule::timeout timeout;
+
+  ioxx::monotonic_time_t const base( static_cast<ioxx::monotonic_time_t>(1) << 20 );
+  ioxx::monotonic_time_t now( base );
+  Schedule schedule(now);
+  size_t dummy_call_counter( 0u );
+  BOOST_REQUIRE_EQUAL(Schedule::coalesce(base + 10u, 0u), base + 10u);
+  BOOST_REQUIRE_EQUAL(Schedule::coalesce(base + 10u, 10u), base + 16u);
+  timeout t1( schedule, 10u, dummy(dummy_call_counter), 10u );
+  timeout t2( schedule, 12u, dummy(dummy_call_counter), 10u );
+  timeout t3( schedule, 15u, dummy(dummy_call_counter), 5u );
+  schedule.in(11u, dummy(dummy_call_counter));
+  BOOST_REQUIRE_EQUAL(schedule.run(), 11u);
+  now += 11u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 5u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
+  BOOST_REQUIRE(t1.extend(3u));         // within slack: stays put
+  now += 5u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 4u);
+  BOOST_REQUIRE(schedule.empty());
+  BOOST_REQUIRE_EQUAL(schedule.wakeups(), 2u);
+  BOOST_REQUIRE_EQUAL(schedule.coalesced(), 2u);
+}
+
+template <class Schedule>
+void use_bounded_run()
+{
+  ioxx::monotonic_time_t now( 1267401600 );
+  Schedule schedule(now);
+  size_t dummy_call_counter( 0u );
+  for (size_t i(0u); i != 5u; ++i)
+    schedule.in(static_cast<ioxx::milliseconds_t>(i), dummy(dummy_call_counter));
+  schedule.in(10u, dummy(dummy_call_counter));
+  now += 5u;
+  BOOST_REQUIRE_EQUAL(schedule.run(2u), 0u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 2u);
+  BOOST_REQUIRE_EQUAL(schedule.run(2u), 0u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 4u);
+  BOOST_REQUIRE_EQUAL(schedule.run(2u), 5u);
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 5u);
+  BOOST_REQUIRE_EQUAL(schedule.run(0u), 5u);
+}
+
+// The bound argument lives in the task, which must survive cancel().
+
+template <class Periodic>
+void cancel_periodic(Periodic * p, std::string const & tag, std::string * seen)
+{
+  p->cancel();
+  *seen = tag;
+}
+
+template <class Schedule>
+void use_periodic()
+{
+  typedef typename Schedule::periodic periodic;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  Schedule schedule(now);
+  size_t dummy_call_counter( 0u );
+  periodic p( schedule, 10u, dummy(dummy_call_counter) );
+  BOOST_REQUIRE(p.pending());
+  BOOST_REQUIRE_EQUAL(schedule.run(), 10u);
+  now += 12u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 8u);      // no drift
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 1u);
+  now += 23u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 5u);      // missed run at +30 is skipped
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 2u);
+  now += 25u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 10u);     // the run due at +60 isn't skipped
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 4u);
+  BOOST_REQUIRE(p.cancel());
+  BOOST_REQUIRE(!p.pending());
+  BOOST_REQUIRE(schedule.empty());
+
+  std::string seen;
+  periodic q( schedule );
+  q.every(10u, boost::bind(&cancel_periodic<periodic>, &q, std::string("tick"), &seen));
+  now += 10u;
+  BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
+  BOOST_REQUIRE_EQUAL(seen, "tick");
+  BOOST_REQUIRE(!q.pending());
+  BOOST_REQUIRE(schedule.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_schedule_timeout_handle )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+
+  use_timeout_handle< ioxx::schedule<> >();
+  use_timeout_handle< ioxx::schedule<std::allocator<void>, task, wheel> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_timeout_extend_is_lazy )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+
+  use_lazy_extend< ioxx::schedule<> >();
+  use_lazy_extend< ioxx::schedule<std::allocator<void>, task, wheel> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_timeout_slack_coalesces )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+
+  use_slack< ioxx::schedule<> >();
+  use_slack< ioxx::schedule<std::allocator<void>, task, wheel> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_schedule_run_is_bounded )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+
+  use_bounded_run< ioxx::schedule<> >();
+  use_bounded_run< ioxx::schedule<std::allocator<void>, task, wheel> >();
+}
+
+BOOST_AUTO_TEST_CASE( test_schedule_periodic )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+
+  use_periodic< ioxx::schedule<> >();
+  use_periodic< ioxx::schedule<std::allocator<void>, task, wheel> >();
+}
+
 static size_t dummy_was_called = 0u;
 void dummy_function() { ++dummy_was_called; }
 
 BOOST_AUTO_TEST_CASE( basic_schedule_test )
 {
   using ioxx::time_of_day;
-  using ioxx::seconds_t;
+  using ioxx::milliseconds_t;
   typedef ioxx::schedule<> scheduler;
   time_of_day now;
-  scheduler schedule(now.current_time_t());
+  scheduler schedule(now.current_monotonic_time());
   BOOST_REQUIRE(schedule.empty());
   BOOST_REQUIRE_EQUAL(schedule.run(), 0u);
   BOOST_REQUIRE_EQUAL(dummy_was_called, 0u);
-  schedule.at(now.current_time_t(), dummy_function);
-  schedule.in(1u, dummy_function);
-  scheduler::task_id tid( schedule.in(5u, dummy_function) );
-  schedule.in(2u, boost::bind(&scheduler::cancel, &schedule, tid));
-  seconds_t delay( schedule.run() );
-  BOOST_REQUIRE_EQUAL(delay, 1u);
+  schedule.at(now.current_monotonic_time(), dummy_function);
+  schedule.in(100u, dummy_function);
+  scheduler::task_id tid( schedule.in(500u, dummy_function) );
+  schedule.in(200u, boost::bind(&scheduler::cancel, &schedule, tid));
+  milliseconds_t delay( schedule.run() );
+  BOOST_REQUIRE_EQUAL(delay, 100u);
   BOOST_REQUIRE_EQUAL(dummy_was_called, 1u);
-  sleep(delay); now.update();
+  usleep(delay * 1000u); now.update();
   delay = schedule.run();
   BOOST_REQUIRE_EQUAL(dummy_was_called, 2u);
-  BOOST_REQUIRE_PREDICATE(std::less_equal<seconds_t>(), (delay)(1u));
-  sleep(delay); now.update();
+  BOOST_REQUIRE_PREDICATE(std::less_equal<milliseconds_t>(), (delay)(100u));
+  usleep(delay * 1000u); now.update();
   delay = schedule.run();
   BOOST_REQUIRE_EQUAL(dummy_was_called, 2u);
   BOOST_REQUIRE_EQUAL(delay, 0u);
   BOOST_REQUIRE(schedule.empty());
 }
+
+class record
+{
+public:
+  record(std::vector<size_t> & log, size_t id) : _log(&log), _id(id) { }
+  void operator() () const              { _log->push_back(_id); }
+
+private:
+  std::vector<size_t> * _log;
+  size_t                _id;
+};
+
+BOOST_AUTO_TEST_CASE( timing_wheel_agrees_with_multimap )
+{
+  typedef boost::function0<void>                                        task;
+  typedef ioxx::schedule<>                                              map_schedule;
+  typedef ioxx::timing_wheel<ioxx::monotonic_time_t, task>              wheel;
+  typedef ioxx::schedule<std::allocator<void>, task, wheel>             wheel_schedule;
+
+  ioxx::monotonic_time_t now( 1267401600 );
+  map_schedule ms(now);
+  wheel_schedule ws(now);
+  std::vector<size_t> mlog, wlog;
+  std::vector<map_schedule::task_id> mids;
+  std::vector<wheel_schedule::task_id> wids;
+  std::vector<bool> cancelled;
+
+  unsigned long rnd( 42u );
+  for (size_t i(0u); i != 20000u; ++i)
+  {
+    rnd = rnd * 1103515245u + 12345u;
+    unsigned long const r( (rnd >> 8) % 1000u );
+    if (r < 500u)
+    {
+      ioxx::monotonic_time_t ts( now );
+      if      (r < 50u)  ts -= static_cast<ioxx::monotonic_time_t>(r);                 // overdue
+      else if (r < 400u) ts += static_cast<ioxx::monotonic_time_t>((rnd >> 4) % 300u);
+      else if (r < 490u) ts += static_cast<ioxx::monotonic_time_t>((rnd >> 4) % 200000u);
+      else               ts += static_cast<ioxx::monotonic_time_t>(1) << 33;           // overflow bucket
+      mids.push_back(ms.at(ts, record(mlog, mids.size())));
+      wids.push_back(ws.at(ts, record(wlog, wids.size())));
+      cancelled.push_back(false);
+    }
+    else if (r < 700u && !mids.empty())
+    {
+      size_t const id( (rnd >> 4) % mids.size() );
+      if (cancelled[id] || std::find(mlog.begin(), mlog.end(), id) != mlog.end()) continue;
+      cancelled[id] = true;
+      BOOST_REQUIRE(ms.cancel(mids[id]));
+      BOOST_REQUIRE(ws.cancel(wids[id]));
+    }
+    else
+    {
+      now += static_cast<ioxx::monotonic_time_t>(r < 990u ? (rnd >> 4) % 50u : (rnd >> 4) % 100000u);
+      BOOST_REQUIRE_EQUAL(ms.run(), ws.run());
+      BOOST_REQUIRE(mlog == wlog);
+    }
+  }
+  now += static_cast<ioxx::monotonic_time_t>(1) << 34;
+  BOOST_REQUIRE_EQUAL(ms.run(), ws.run());
+  BOOST_REQUIRE(mlog == wlog);
+  BOOST_REQUIRE(ms.empty());
+  BOOST_REQUIRE(ws.empty());
+}
+
+BOOST_AUTO_TEST_CASE( test_schedule_stats )
+{
+  typedef boost::function0<void>                                                task;
+  typedef ioxx::schedule<>::task_queue                                          task_queue;
+  typedef ioxx::schedule<std::allocator<void>, task, task_queue, ioxx::loop_stats> scheduler;
+
+  ioxx::monotonic_time_t now( 1000u );
+  scheduler schedule(now);
+  size_t dummy_call_counter( 0u );
+  schedule.at(1000u, dummy(dummy_call_counter));
+  schedule.at(1010u, dummy(dummy_call_counter));
+  schedule.at(1020u, dummy(dummy_call_counter));
+  schedule.run();
+  now = 1025u;
+  schedule.run();
+  BOOST_REQUIRE_EQUAL(dummy_call_counter, 3u);
+  ioxx::loop_stats const & stats( schedule.schedule_stats() );
+  BOOST_REQUIRE_EQUAL(stats.task_time().samples(), 3u);
+  BOOST_REQUIRE_EQUAL(stats.task_lateness().samples(), 3u);
+  BOOST_REQUIRE_EQUAL(stats.task_lateness().sum(), 0u + 15u + 5u);
+  BOOST_REQUIRE_EQUAL(stats.task_lateness().count(0u), 1u);
+  BOOST_REQUIRE_EQUAL(stats.task_lateness().percentile(1.0), 16u);
+}